@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Run xbench against glazier on a headless Xvfb server, for each of the
+# window counts given as arguments (or in $SIZES).
+# Results are written on stdout, one record per line: the "bench" lines
+# come from xbench, the others are glazier's own statistics (see the
+# SIGNALS section in glazier.1). Build glazier with -DSTATS to get the
+# number of X requests per event.
+# The screen is as large as an 8K display by default, so that the memory
+# workload reaches the windows that are too large for a border pixmap.
+# Set $SOAK to a number of drags to also check that the resources held
+# by glazier on the server don't grow over time.
+
+DISPLAY=${BENCH_DISPLAY:-:99}
+SIZES=${*:-${SIZES:-100 1000 5000}}
+SCREEN=${BENCH_SCREEN:-7680x4320x24}
+STATS=$(mktemp)
+
+export DISPLAY
+
+Xvfb $DISPLAY -screen 0 $SCREEN -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null; rm -f $STATS' EXIT INT TERM
+
+# wait for the server to accept connections
+i=0
+until [ -e /tmp/.X11-unix/X${DISPLAY#:} ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "Xvfb did not start" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+for n in $SIZES; do
+	./xbench -n $n -d ${SOAK:-0} -s $STATS -g ./glazier || exit 1
+	rm -f $STATS
+done
@@ -15,5 +15,34 @@ int inner_border = 2;
 uint32_t border_color = 0x666666;
 uint32_t border_color_active = 0xdeadca7;
 
+/* windows whose border pixmap would take more pixels than this get a
+ * plain border of the line color instead, rather than tens of MB of
+ * server memory. The default spares windows up to 2560x1440. 0 to
+ * always do so */
+int border_pixmap_max = 1 << 22;
+
 /* move/resize step amound in pixels */
 int move_step = 8;
+
+/* distance in pixels under which dragged windows edges stick to the
+ * edges of other windows and monitors, 0 to disable */
+int snap = 16;
+
+/* pointer motion handling while moving/resizing windows:
+ * MOTION_COALESCE: only process the latest of all queued motion events
+ * MOTION_THROTTLE: only process one motion event per monitor frame */
+int motion = MOTION_COALESCE;
+
+/* move/resize the windows themselves rather than drawing an outline (-o) */
+int opaque = 0;
+
+/* follow the windows content with the DAMAGE extension, so that their
+ * border color is sampled again whenever their corners change, rather
+ * than only when they get mapped or resized (-c) */
+int content = 0;
+
+/* minimum time in milliseconds between two samples of a window whose
+ * content is followed, so that video players don't flood the WM. Also
+ * the time windows mapped or resized are given to repaint before their
+ * color is sampled */
+int damage_interval = 250;
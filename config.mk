@@ -5,7 +5,14 @@ PREFIX = /usr/local
 MANDIR = ${PREFIX}/man
 
 CPPFLAGS = -I/usr/X11R6/include -I/usr/local/include
+# count X requests and round trips, reported on SIGUSR1 (libxcb 1.13 or
+# later, and add -ldl to LIBS with glibc older than 2.34)
+#CPPFLAGS += -DSTATS
 CFLAGS = -Wall -Wextra -pedantic -g
 LDFLAGS = -L./libwm -L/usr/X11R6/lib -L/usr/local/lib ${LIBS}
-LIBS = -lwm -lxcb-cursor -lxcb-image -lxcb-randr -lxcb
+LIBS = -lwm -lxcb-cursor -lxcb-image -lxcb-damage -lxcb-randr -lxcb-shm -lxcb-sync -lxcb -lpthread
+
+# xbench, see `make bench`
+BENCHLDFLAGS = -L/usr/X11R6/lib -L/usr/local/lib ${BENCHLIBS}
+BENCHLIBS = -lxcb-res -lxcb-xtest -lxcb
 
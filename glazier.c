@@ -1,9 +1,32 @@
+#ifdef STATS
+#define _GNU_SOURCE /* RTLD_NEXT */
+#include <dlfcn.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_cursor.h>
 #include <xcb/xcb_image.h>
+#include <xcb/damage.h>
 #include <xcb/randr.h>
+#include <xcb/shm.h>
+#include <xcb/sync.h>
 
 #include "arg.h"
 #include "wm.h"
@@ -24,6 +47,122 @@ struct cursor_t {
 	int mode;
 };
 
+struct border_t {
+	int w, h, d, b, i;
+	int focused;
+	uint32_t bg;
+	xcb_pixmap_t px;
+	unsigned long used;
+};
+
+struct drag_t {
+	int x, y, w, h;
+	int pending;
+	int inflight;
+	int syncing;
+	int resized;
+	long sent;
+	long start;
+	unsigned long requests;
+};
+
+struct monitor_t {
+	int x, y, w, h;
+	uint32_t interval;
+};
+
+struct ctl_t {
+	int fd;
+	size_t len, olen;
+	char buf[1024];
+	char out[4096];
+};
+
+struct edge_t {
+	int pos;
+	int lo, hi;
+	xcb_window_t wid;
+};
+
+struct pending_t {
+	xcb_window_t wid;
+	int n, got;
+	unsigned int seq[2];
+	void *reply[2];
+	void (*cont)(xcb_window_t, void **);
+	struct pending_t *next;
+};
+
+struct hints_t {
+	uint32_t flags;
+	int minw, minh;
+	int maxw, maxh;
+	int incw, inch;
+	int basew, baseh;
+};
+
+struct client_t {
+	xcb_window_t wid;
+	int x, y, w, h, b, d;
+	int mapped;
+	int ignored;
+	int indexed;
+	int listed;
+	xcb_window_t above;
+	int synced;
+	xcb_sync_counter_t counter;
+	xcb_sync_alarm_t alarm;
+	int64_t syncval;
+	uint32_t bg;
+	unsigned int sampling;
+	xcb_damage_damage_t damage;
+	int dirty;
+	long sampled;
+	struct hints_t hints;
+	xcb_configure_request_event_t req;
+	struct client_t *dnext;
+	struct client_t *cnext;
+	struct client_t *next;
+};
+
+/*
+ * Queries sent by the worker thread, and their results, see worker().
+ */
+struct job_t {
+	int type;
+	xcb_window_t wid;
+	int w, h;
+	unsigned int gen;
+	int found;
+	uint32_t color;
+	struct hints_t hints;
+};
+
+/* single producer, single consumer queue */
+struct ring_t {
+	atomic_uint head;
+	atomic_uint tail;
+	struct job_t job[1024];
+};
+
+enum {
+	JOB_SAMPLE,
+	JOB_HINTS,
+};
+
+enum {
+	AXIS_X,
+	AXIS_Y,
+};
+
+/* WM_SIZE_HINTS flags, as defined by the ICCCM */
+enum {
+	HINT_MIN  = 1 << 4,
+	HINT_MAX  = 1 << 5,
+	HINT_INC  = 1 << 6,
+	HINT_BASE = 1 << 8,
+};
+
 enum {
 	XHAIR_DFLT,
 	XHAIR_MOVE,
@@ -31,6 +170,25 @@ enum {
 	XHAIR_TELE,
 };
 
+enum {
+	WM_PROTOCOLS,
+	UTF8_STRING,
+	NET_SUPPORTED,
+	NET_SUPPORTING_WM_CHECK,
+	NET_WM_NAME,
+	NET_CLIENT_LIST,
+	NET_CLIENT_LIST_STACKING,
+	NET_ACTIVE_WINDOW,
+	NET_WM_SYNC_REQUEST,
+	NET_WM_SYNC_REQUEST_COUNTER,
+	ATOM_LAST,
+};
+
+enum {
+	MOTION_COALESCE,
+	MOTION_THROTTLE,
+};
+
 enum {
 	GRAB_NONE = 0,
 	GRAB_MOVE,
@@ -41,17 +199,108 @@ enum {
 #include "config.h"
 
 void usage(char *);
+static struct client_t *client(xcb_window_t);
+static struct client_t *client_add(xcb_window_t);
+static struct client_t *client_fetch(xcb_window_t);
+static void client_del(xcb_window_t);
+static int getattr(xcb_window_t, int);
+static int teleport(xcb_window_t, int, int, int, int);
+static int setborder(xcb_window_t, int, int);
 static int takeover();
+static int getatoms();
 static int adopt(xcb_window_t);
+static void subscribe(xcb_window_t);
+static void restart();
+static void state_save(FILE *);
+static void state_client(FILE *, struct client_t *);
+static int state_load(int);
+static int resume();
+static void resume_check(xcb_window_t, void **);
+static void resume_tree(xcb_window_t, void **);
+static int sample(xcb_window_t);
+static void sample_later(struct client_t *);
+static void damage_init();
+static void damage_cancel(struct client_t *);
+static int damage_timeout();
+static int damage_flush();
+static int ring_push(struct ring_t *, struct job_t *);
+static int ring_pop(struct ring_t *, struct job_t *);
+static int worker_init();
+static void *worker(void *);
+static void worker_send(struct job_t *, int, unsigned int *);
+static void worker_recv(struct job_t *, int, unsigned int *);
+static void worker_push(struct job_t *);
+static void worker_kick();
+static int worker_apply(int);
+static int worker_flush();
+static void worker_settle();
 static uint32_t backpixel(xcb_window_t);
+static void render(xcb_pixmap_t, xcb_gcontext_t, struct border_t *);
+static xcb_gcontext_t getgc(xcb_drawable_t, int);
+static xcb_pixmap_t getpixmap(xcb_window_t, struct border_t *);
 static int paint(xcb_window_t);
 static int inflate(xcb_window_t, int);
-static int outline(xcb_drawable_t, int, int, int, int);
+static void hints_fetch(xcb_window_t);
+static void hints_parse(struct hints_t *, xcb_get_property_reply_t *);
+static int sizehint(xcb_window_t, int *, int *);
+static void edges_del(struct client_t *);
+static void edges_update(struct client_t *);
+static int snapedge(int, int, int, int, struct monitor_t *);
+static int dragrect(int, int, int, int *, int *, int *, int *);
+static int outline(int, int, int, int);
+static int getcursors();
+static int grab(uint32_t, int);
+static long now();
+static int drag(int, int, int, int);
+static int drag_flush();
+static int drag_timeout();
+static int focus_flush();
+static int config_apply(struct client_t *);
+static int config_forward(xcb_configure_request_event_t *);
+static void config_cancel(struct client_t *);
+static int config_flush();
+static void defer(xcb_window_t, void (*)(xcb_window_t, void **), int, unsigned int *);
+static int pending_step(struct pending_t *, int);
+static void pending_run();
+static int pending_flush();
+static void pending_settle(xcb_window_t);
+static void place(xcb_window_t, void **);
+static int syncsetup(xcb_window_t);
+static void sync_props(xcb_window_t, void **);
+static void sync_counter(xcb_window_t, void **);
+static int syncrequest(struct client_t *);
+static xcb_generic_event_t *coalesce(xcb_generic_event_t *);
+static void ev_init();
 static int ev_callback(xcb_generic_event_t *);
+static void stats(FILE *);
+static void sigwake();
+static void sigusr1(int);
+static void sighup(int);
+
+/* EWMH */
+static int ewmh_init();
+static void ewmh_add(xcb_window_t, int);
+static void ewmh_del(xcb_window_t);
+static void ewmh_restack(struct client_t *);
+static void ewmh_tree(xcb_window_t, void **);
+static void ewmh_publish(int);
+static int ewmh_flush();
+
+/* control socket */
+static int ctl_init(char *);
+static int ctl_pollfd(struct pollfd *, int);
+static void ctl_handle(struct pollfd *, int);
+static void ctl_reply(struct ctl_t *, const char *, ...);
+static void ctl_flush(struct ctl_t *);
+static void ctl_close(struct ctl_t *);
+static void ctl_exec(struct ctl_t *, char *);
 
 /* XRandR specific functions */
 static int crossedge(xcb_window_t);
 static int snaptoedge(xcb_window_t);
+static int getmonitors();
+static struct monitor_t *monitor(int, int);
+static uint32_t interval(int, int, uint32_t);
 
 /* XCB events callbacks */
 static int cb_default(xcb_generic_event_t *);
@@ -64,14 +313,123 @@ static int cb_enter(xcb_generic_event_t *);
 static int cb_focus(xcb_generic_event_t *);
 static int cb_configreq(xcb_generic_event_t *);
 static int cb_configure(xcb_generic_event_t *);
+static int cb_destroy(xcb_generic_event_t *);
+static int cb_map(xcb_generic_event_t *);
+static int cb_unmap(xcb_generic_event_t *);
+static int cb_reparent(xcb_generic_event_t *);
+static int cb_property(xcb_generic_event_t *);
+static int cb_message(xcb_generic_event_t *);
+static int cb_randr(xcb_generic_event_t *);
+static int cb_damage(xcb_generic_event_t *);
+static int cb_alarm(xcb_generic_event_t *);
 
 int verbose = 0;
+int debug = 0;
+char *statsfile = NULL;
+char *ctlpath = NULL;
+char **args = NULL;
+int statefd = -1;
 xcb_connection_t *conn;
 xcb_screen_t     *scrn;
 xcb_window_t      curwid;
+xcb_window_t      focuswid;
 struct cursor_t   cursor;
 
-static const char *evname[] = {
+/* crosshairs from config.h, loaded once by getcursors() */
+static xcb_cursor_t xcursor[LEN(xhair)];
+
+/* window table, indexed by window ID */
+static struct client_t *clients[256];
+
+/* edges of all mapped windows, sorted by position, see edges_update() */
+static struct edge_t *edges[2];
+static int nedges, maxedges;
+
+/* last color sample requested, see sample() */
+static unsigned int samplegen;
+
+/* windows to sample again, see sample_later() and cb_damage() */
+static struct client_t *damaged;
+static const xcb_query_extension_reply_t *xdamage;
+
+/* worker thread, its connection and queues, see worker_init() */
+static xcb_connection_t *wconn;
+static struct ring_t jobs, results;
+static int jobfd[2], resfd[2];
+static int queued, inflight;
+static struct job_t batch[64];
+
+/* shared memory the worker reads corners into, 4 pixels per job */
+static xcb_shm_seg_t shmseg;
+static uint8_t *shmbuf;
+
+/* live move/resize state, see drag() */
+static struct drag_t dragging;
+static struct {
+	unsigned long drags, requests, ms;
+} dragstats;
+
+/* control socket and its clients, see ctl_init() */
+static int ctlfd = -1;
+static struct ctl_t ctls[8];
+
+/* managed windows, by mapping and stacking order, see ewmh_add() */
+static xcb_window_t *clist, *slist;
+static int nclist, maxclist;
+static xcb_window_t active;
+static int restacking;
+
+/* requests waiting for their replies, in the order they were sent */
+static struct pending_t *pending, **pendtail = &pending;
+
+/* windows with a pending configure request, see cb_configreq() */
+static struct client_t *configs;
+static struct {
+	unsigned long requests, merged;
+} cfgstats;
+
+/* window to focus at the end of the events batch, see cb_enter() */
+static xcb_window_t focusreq;
+
+/* event read ahead of time by coalesce() */
+static xcb_generic_event_t *lookahead;
+
+/* monitors layout and their refresh rate, see getmonitors() */
+static struct monitor_t monitors[16];
+static int nmonitors;
+static int relayout;
+static const xcb_query_extension_reply_t *randr;
+static const xcb_query_extension_reply_t *xsync;
+
+/* event dispatch table and handlers latency, see ev_init() */
+static int (*handler[128])(xcb_generic_event_t *);
+static unsigned long latency[128][16];
+static volatile sig_atomic_t dumpstats;
+static volatile sig_atomic_t restarting;
+static int sigfd[2];
+
+/* border pixmaps cache, see getpixmap() */
+static struct border_t borders[32];
+static struct {
+	unsigned long hits, misses, evictions;
+} pxstats;
+
+static const char *atomname[] = {
+	[WM_PROTOCOLS]                = "WM_PROTOCOLS",
+	[UTF8_STRING]                 = "UTF8_STRING",
+	[NET_SUPPORTED]               = "_NET_SUPPORTED",
+	[NET_SUPPORTING_WM_CHECK]     = "_NET_SUPPORTING_WM_CHECK",
+	[NET_WM_NAME]                 = "_NET_WM_NAME",
+	[NET_CLIENT_LIST]             = "_NET_CLIENT_LIST",
+	[NET_CLIENT_LIST_STACKING]    = "_NET_CLIENT_LIST_STACKING",
+	[NET_ACTIVE_WINDOW]           = "_NET_ACTIVE_WINDOW",
+	[NET_WM_SYNC_REQUEST]         = "_NET_WM_SYNC_REQUEST",
+	[NET_WM_SYNC_REQUEST_COUNTER] = "_NET_WM_SYNC_REQUEST_COUNTER",
+};
+
+static xcb_atom_t atoms[ATOM_LAST];
+
+static const char *evname[128] = {
 	[0]                     = "EVENT_ERROR",
 	[XCB_CREATE_NOTIFY]     = "CREATE_NOTIFY",
 	[XCB_DESTROY_NOTIFY]    = "DESTROY_NOTIFY",
@@ -117,680 +475,4059 @@ static const struct ev_callback_t cb[] = {
 	{ XCB_FOCUS_OUT,         cb_focus },
 	{ XCB_CONFIGURE_REQUEST, cb_configreq },
 	{ XCB_CONFIGURE_NOTIFY,  cb_configure },
+	{ XCB_DESTROY_NOTIFY,    cb_destroy },
+	{ XCB_MAP_NOTIFY,        cb_map },
+	{ XCB_UNMAP_NOTIFY,      cb_unmap },
+	{ XCB_REPARENT_NOTIFY,   cb_reparent },
+	{ XCB_PROPERTY_NOTIFY,   cb_property },
+	{ XCB_CLIENT_MESSAGE,    cb_message },
 };
 
-void
-usage(char *name)
-{
-	fprintf(stderr, "usage: %s [-vh]\n", name);
-}
+#ifdef STATS
+/*
+ * Request accounting. libxcb sends every request through
+ * xcb_send_request_with_fds64(), and waits on replies in
+ * xcb_wait_for_reply(), xcb_wait_for_reply64() and xcb_request_check(),
+ * whichever library calls them. These are overridden to keep count of
+ * the last sequence number, the replies waited on and the time spent
+ * blocked on the WM connection, without sending anything more to the
+ * server. Callbacks and every blocking helper, wrapped in a macro, are
+ * then charged with the difference between entry and exit.
+ * None of this is compiled in unless STATS is defined, see config.mk.
+ */
+enum {
+	H_WM_GET_ATTRIBUTE,
+	H_WM_GET_WINDOWS,
+	H_WM_SET_FOCUS,
+	H_WM_REG_WINDOW_EVENT,
+	H_CURSOR_CONTEXT_NEW,
+	H_GET_GEOMETRY,
+	H_GET_WINDOW_ATTRIBUTES,
+	H_GET_INPUT_FOCUS,
+	H_GET_PROPERTY,
+	H_INTERN_ATOM,
+	H_SYNC_QUERY_COUNTER,
+	H_RANDR_GET_SCREEN_RESOURCES,
+	H_RANDR_GET_CRTC_INFO,
+	H_RANDR_GET_MONITORS,
+	H_WAIT_FOR_REPLY,
+	H_LAST,
+};
+
+static const char *helpername[] = {
+	[H_WM_GET_ATTRIBUTE]           = "wm_get_attribute",
+	[H_WM_GET_WINDOWS]             = "wm_get_windows",
+	[H_WM_SET_FOCUS]               = "wm_set_focus",
+	[H_WM_REG_WINDOW_EVENT]        = "wm_reg_window_event",
+	[H_CURSOR_CONTEXT_NEW]         = "xcb_cursor_context_new",
+	[H_GET_GEOMETRY]               = "xcb_get_geometry_reply",
+	[H_GET_WINDOW_ATTRIBUTES]      = "xcb_get_window_attributes_reply",
+	[H_GET_INPUT_FOCUS]            = "xcb_get_input_focus_reply",
+	[H_GET_PROPERTY]               = "xcb_get_property_reply",
+	[H_INTERN_ATOM]                = "xcb_intern_atom_reply",
+	[H_SYNC_QUERY_COUNTER]         = "xcb_sync_query_counter_reply",
+	[H_RANDR_GET_SCREEN_RESOURCES] = "xcb_randr_get_screen_resources_current_reply",
+	[H_RANDR_GET_CRTC_INFO]        = "xcb_randr_get_crtc_info_reply",
+	[H_RANDR_GET_MONITORS]         = "xcb_randr_get_monitors_reply",
+	[H_WAIT_FOR_REPLY]             = "xcb_wait_for_reply",
+};
+
+struct reqstat_t {
+	unsigned long calls;
+	unsigned long requests;
+	unsigned long replies;
+	unsigned long blocked;
+};
+
+struct reqcount_t {
+	uint64_t seq;
+	unsigned long replies;
+	unsigned long blocked;
+};
+
+/* the last slot accounts for everything happening outside callbacks */
+static struct reqstat_t evstat[129], helperstat[H_LAST];
+static size_t curev = LEN(evstat) - 1;
+static struct reqcount_t st_conn, st_frame;
+static long long st_int;
+static void *st_ptr;
+
+/* the libxcb functions overridden below */
+static struct {
+	uint64_t (*send)(xcb_connection_t *, int, struct iovec *,
+		const xcb_protocol_request_t *, unsigned int, int *);
+	void *(*wait)(xcb_connection_t *, unsigned int, xcb_generic_error_t **);
+	void *(*wait64)(xcb_connection_t *, uint64_t, xcb_generic_error_t **);
+	xcb_generic_error_t *(*check)(xcb_connection_t *, xcb_void_cookie_t);
+} st_next;
+
+static void st_init();
+static void st_check();
+static void st_waited(xcb_connection_t *, struct timespec *);
+static void st_enter(int);
+static void st_leave(int);
+static long long st_leave_int(int);
+static void *st_leave_ptr(int);
+
+#define STAT_INT(h, call) (st_enter(h), st_int = (call), st_leave_int(h))
+#define STAT_PTR(h, call) (st_enter(h), st_ptr = (call), st_leave_ptr(h))
+
+#define wm_get_attribute(...)       STAT_INT(H_WM_GET_ATTRIBUTE, wm_get_attribute(__VA_ARGS__))
+#define wm_get_windows(...)         STAT_INT(H_WM_GET_WINDOWS, wm_get_windows(__VA_ARGS__))
+#define wm_set_focus(...)           STAT_INT(H_WM_SET_FOCUS, wm_set_focus(__VA_ARGS__))
+#define wm_reg_window_event(...)    STAT_INT(H_WM_REG_WINDOW_EVENT, wm_reg_window_event(__VA_ARGS__))
+#define xcb_cursor_context_new(...) STAT_INT(H_CURSOR_CONTEXT_NEW, xcb_cursor_context_new(__VA_ARGS__))
+#define xcb_get_geometry_reply(...) STAT_PTR(H_GET_GEOMETRY, xcb_get_geometry_reply(__VA_ARGS__))
+#define xcb_get_window_attributes_reply(...) STAT_PTR(H_GET_WINDOW_ATTRIBUTES, xcb_get_window_attributes_reply(__VA_ARGS__))
+#define xcb_get_input_focus_reply(...) STAT_PTR(H_GET_INPUT_FOCUS, xcb_get_input_focus_reply(__VA_ARGS__))
+#define xcb_get_property_reply(...) STAT_PTR(H_GET_PROPERTY, xcb_get_property_reply(__VA_ARGS__))
+#define xcb_intern_atom_reply(...)  STAT_PTR(H_INTERN_ATOM, xcb_intern_atom_reply(__VA_ARGS__))
+#define xcb_sync_query_counter_reply(...) STAT_PTR(H_SYNC_QUERY_COUNTER, xcb_sync_query_counter_reply(__VA_ARGS__))
+#define xcb_randr_get_screen_resources_current_reply(...) STAT_PTR(H_RANDR_GET_SCREEN_RESOURCES, xcb_randr_get_screen_resources_current_reply(__VA_ARGS__))
+#define xcb_randr_get_crtc_info_reply(...) STAT_PTR(H_RANDR_GET_CRTC_INFO, xcb_randr_get_crtc_info_reply(__VA_ARGS__))
+#define xcb_randr_get_monitors_reply(...) STAT_PTR(H_RANDR_GET_MONITORS, xcb_randr_get_monitors_reply(__VA_ARGS__))
+#define xcb_wait_for_reply(...)     STAT_PTR(H_WAIT_FOR_REPLY, xcb_wait_for_reply(__VA_ARGS__))
 
 /*
- * Every window that shouldn't be ignored (override_redirect) is adoped
- * by the WM when it is created, or when the WM is started.
- * When a window is created, it is centered on the cursor, before it
- * gets mapped on screen. Windows that are already visible are not moved.
- * Some events are also registered by the WM for these windows.
+ * Look the libxcb functions up before the first request is sent, and
+ * before the worker thread might call them.
  */
-int
-adopt(xcb_window_t wid)
+void
+st_init()
 {
-	if (wm_is_ignored(wid))
-		return -1;
+	*(void **)&st_next.send = dlsym(RTLD_NEXT, "xcb_send_request_with_fds64");
+	*(void **)&st_next.wait = dlsym(RTLD_NEXT, "xcb_wait_for_reply");
+	*(void **)&st_next.wait64 = dlsym(RTLD_NEXT, "xcb_wait_for_reply64");
+	*(void **)&st_next.check = dlsym(RTLD_NEXT, "xcb_request_check");
 
-	return wm_reg_window_event(wid, XCB_EVENT_MASK_ENTER_WINDOW
-		| XCB_EVENT_MASK_FOCUS_CHANGE
-		| XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+	if (!st_next.send || !st_next.wait || !st_next.wait64 || !st_next.check) {
+		fprintf(stderr, "STATS: %s\n", dlerror());
+		exit(1);
+	}
 }
 
 /*
- * Return the color of the pixel in one of the window corners.
- * Each corner is tested in a clockwise fashion until an uncovered region
- * is found. When such pixel is found, the color is returned.
- * If no color is found a default of border_color is returned.
+ * The overrides have no effect when libxcb is linked statically, or
+ * binds its own symbols (-Bsymbolic), and every count would then read
+ * 0. Check with a single round trip that they are in the way, and
+ * refuse to run otherwise.
  */
-uint32_t
-backpixel(xcb_window_t wid)
+void
+st_check()
 {
-	int w, h;
-	uint32_t color;
-	xcb_image_t *px;
-
-	w = wm_get_attribute(wid, ATTR_W);
-	h = wm_get_attribute(wid, ATTR_H);
+	unsigned long replies;
+	xcb_get_input_focus_cookie_t ck;
 
-	px = xcb_image_get(conn, wid, 0, 0, 1, 1, 0xffffffff, XCB_IMAGE_FORMAT_Z_PIXMAP);
-	if (px) color = xcb_image_get_pixel(px, 0, 0);
+	replies = st_conn.replies;
+	ck = xcb_get_input_focus(conn);
+	free((xcb_get_input_focus_reply)(conn, ck, NULL));
 
-	if (!color) {
-		px = xcb_image_get(conn, wid, w - 1, 0, 1, 1, 0xffffffff, XCB_IMAGE_FORMAT_Z_PIXMAP);
-		if (px) color = xcb_image_get_pixel(px, 0, 0);
+	if ((unsigned int)st_conn.seq != ck.sequence || st_conn.replies != replies + 1) {
+		fprintf(stderr, "STATS: cannot count requests with this libxcb\n");
+		exit(1);
 	}
+}
 
-	if (!color) {
-		px = xcb_image_get(conn, wid, 0, h - 1, 1, 1, 0xffffffff, XCB_IMAGE_FORMAT_Z_PIXMAP);
-		if (px) color = xcb_image_get_pixel(px, 0, 0);
-	}
+uint64_t
+xcb_send_request_with_fds64(xcb_connection_t *c, int flags,
+	struct iovec *vector, const xcb_protocol_request_t *req,
+	unsigned int num_fds, int *fds)
+{
+	uint64_t seq;
 
-	if (!color) {
-		px = xcb_image_get(conn, wid, w, h, 1, 1, 0xffffffff, XCB_IMAGE_FORMAT_Z_PIXMAP);
-		if (px) color = xcb_image_get_pixel(px, 0, 0);
-	}
+	seq = st_next.send(c, flags, vector, req, num_fds, fds);
+	if (c == conn && seq)
+		st_conn.seq = seq;
 
-	return color ? color : border_color;
+	return seq;
 }
 
-/*
- * Paint double borders around the window. The background is taken from
- * the window content via backpixel(), and the border line is drawn on
- * top of it using the colors defined in config.h.
- *
- * Note: drawing on the borders require specifying regions from position
- * the top-left corner of the window itself. Drawing on the border pixmap
- * is done by drawing outside the window, and then wrapping over to the
- * left side. For example, assuming a window of 200x100, with a 10px
- * border, drawing a 5px square in the top left of the border means drawing
- * a 5x5 rectangle at position 210,110. The area does not wrap around
- * indefinitely though, so drawing a rectangle of 10x10 or 200x10 at
- * position 210,110 would have the same effect: draw a 10x10 square in
- * the top right. uugh…
- */
-int
-paint(xcb_window_t wid)
+/* parenthesized, as the name is also a macro, see above */
+void *
+(xcb_wait_for_reply)(xcb_connection_t *c, unsigned int request,
+	xcb_generic_error_t **e)
 {
-	int val[2], w, h, d, b, i;
-	xcb_pixmap_t px;
-	xcb_gcontext_t gc;
+	void *r;
+	struct timespec t;
 
-	w = wm_get_attribute(wid, ATTR_W);
-	h = wm_get_attribute(wid, ATTR_H);
-	d = wm_get_attribute(wid, ATTR_D);
-	b = wm_get_attribute(wid, ATTR_B);
-	i = inner_border;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	r = st_next.wait(c, request, e);
+	st_waited(c, &t);
 
-	if (i > b)
-		return -1;
+	return r;
+}
 
-	px = xcb_generate_id(conn);
-	gc = xcb_generate_id(conn);
+void *
+xcb_wait_for_reply64(xcb_connection_t *c, uint64_t request,
+	xcb_generic_error_t **e)
+{
+	void *r;
+	struct timespec t;
 
-	val[0] = backpixel(wid);
-	xcb_create_gc(conn, gc, wid, XCB_GC_FOREGROUND, val);
-	xcb_create_pixmap(conn, d, px, wid, w + 2*b, h + 2*b);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	r = st_next.wait64(c, request, e);
+	st_waited(c, &t);
 
-	/* background color */
-	xcb_rectangle_t bg = { 0, 0, w + 2*b, h + 2*b };
+	return r;
+}
 
-	xcb_poly_fill_rectangle(conn, px, gc, 1, &bg);
+xcb_generic_error_t *
+xcb_request_check(xcb_connection_t *c, xcb_void_cookie_t cookie)
+{
+	xcb_generic_error_t *r;
+	struct timespec t;
 
-	/* abandon all hopes already */
-	xcb_rectangle_t r[] = {
-		{w+(b-i)/2,0,i,h+(b+i)/2},             /* right */
-		{w+b+(b-i)/2,0,i,h+(b+i)/2},           /* left */
-		{0,h+(b-i)/2,w+(b-i)/2+i,i},           /* bottom; bottom-right */
-		{0,h+b+(b-i)/2,w+(b+i)/2,i},           /* top; top-right */
-		{w+b+(b-i)/2,h+b+(b-i)/2,i+(b-i/2),i}, /* top-left corner; top-part */
-		{w+b+(b-i)/2,h+b+(b-i)/2,i,i+(b-i/2)}, /* top-left corner; left-part */
-		{w+b+(b-i)/2,h+(b-i)/2,i+(b-i)/2,i},   /* top-right corner; right-part */
-		{w+(b-i)/2,h+b+(b-i)/2,i,i+(b-i)/2}    /* bottom-left corner; bottom-part */
-	};
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	r = st_next.check(c, cookie);
+	st_waited(c, &t);
 
-	val[0] = (wid == wm_get_focus()) ? border_color_active : border_color;
-	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, val);
-	xcb_poly_fill_rectangle(conn, px, gc, 8, r);
+	return r;
+}
 
-	xcb_change_window_attributes(conn, wid, XCB_CW_BORDER_PIXMAP, &px);
+/*
+ * Account for a reply waited on since `t0`. The worker thread has a
+ * connection of its own, which is not accounted for.
+ */
+void
+st_waited(xcb_connection_t *c, struct timespec *t0)
+{
+	unsigned long us;
+	struct timespec t;
 
-	xcb_free_pixmap(conn, px);
-	xcb_free_gc(conn, gc);
+	if (c != conn)
+		return;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	us = (t.tv_sec - t0->tv_sec) * 1000000
+		+ (t.tv_nsec - t0->tv_nsec) / 1000;
+
+	st_conn.replies++;
+	st_conn.blocked += us;
+	evstat[curev].replies++;
+	evstat[curev].blocked += us;
 }
 
 /*
- * Inflating a window will grow it both vertically and horizontally in
- * all 4 directions, thus making it look like it is inflating.
- * The window can be "deflated" by providing a negative `step` value.
+ * Helpers are not nested, so a single frame is enough to save the state
+ * on entry.
  */
-int
-inflate(xcb_window_t wid, int step)
+void
+st_enter(int h)
 {
-	int x, y, w, h;
+	(void)h;
+	st_frame = st_conn;
+}
 
-	x = wm_get_attribute(wid, ATTR_X) - step/2;
-	y = wm_get_attribute(wid, ATTR_Y) - step/2;
-	w = wm_get_attribute(wid, ATTR_W) + step;
-	h = wm_get_attribute(wid, ATTR_H) + step;
+void
+st_leave(int h)
+{
+	helperstat[h].calls++;
+	helperstat[h].requests += st_conn.seq - st_frame.seq;
+	helperstat[h].replies += st_conn.replies - st_frame.replies;
+	helperstat[h].blocked += st_conn.blocked - st_frame.blocked;
+}
 
-	wm_teleport(wid, x, y, w, h);
-	paint(wid);
+long long
+st_leave_int(int h)
+{
+	st_leave(h);
+	return st_int;
+}
 
-	return 0;
+void *
+st_leave_ptr(int h)
+{
+	st_leave(h);
+	return st_ptr;
+}
+#endif /* STATS */
+
+void
+usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-cdovh] [-s file] [-S socket] [-R fd]\n", name);
 }
 
 /*
- * When the WM is started, it will take control of the existing windows.
- * This means registering events on them and setting the borders if they
- * are mapped. This function is only supposed to run once at startup,
- * as the callback functions will take control of new windows
+ * The WM keeps track of the geometry and map state of every top-level
+ * window in an in-process table, so that looking up an attribute doesn't
+ * cost a round trip to the server.
+ * Entries are created by XCB_CREATE_NOTIFY (or on first lookup for
+ * windows that existed before the WM), kept up to date by
+ * XCB_CONFIGURE_NOTIFY, XCB_MAP_NOTIFY and XCB_UNMAP_NOTIFY, and removed
+ * on XCB_DESTROY_NOTIFY.
  */
-int
-takeover()
+struct client_t *
+client(xcb_window_t wid)
 {
-	int i, n;
-	xcb_window_t *orphans, wid;
+	struct client_t *c;
 
-	n = wm_get_windows(scrn->root, &orphans);
+	for (c = clients[wid % LEN(clients)]; c; c = c->next)
+		if (c->wid == wid)
+			return c;
 
-	for (i = 0; i < n; i++) {
-		wid = orphans[i];
-		if (wm_is_ignored(wid))
-			continue;
+	return NULL;
+}
 
-		if (verbose)
-			fprintf(stderr, "Adopting 0x%08x\n", wid);
+struct client_t *
+client_add(xcb_window_t wid)
+{
+	struct client_t *c;
 
-		adopt(wid);
-		if (wm_is_mapped(wid)) {
-			wm_set_border(border, 0, wid);
-			paint(wid);
+	if ((c = client(wid)))
+		return c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->wid = wid;
+	c->bg = border_color;
+	c->next = clients[wid % LEN(clients)];
+	clients[wid % LEN(clients)] = c;
+
+	return c;
+}
+
+void
+client_del(xcb_window_t wid)
+{
+	struct client_t **p, *c;
+
+	for (p = &clients[wid % LEN(clients)]; (c = *p); p = &c->next) {
+		if (c->wid == wid) {
+			if (c->dirty)
+				damage_cancel(c);
+			if (c->damage)
+				xcb_damage_destroy(conn, c->damage);
+			if (c->req.value_mask)
+				config_cancel(c);
+			if (c->indexed)
+				edges_del(c);
+			ewmh_del(wid);
+			if (c->alarm)
+				xcb_sync_destroy_alarm(conn, c->alarm);
+			*p = c->next;
+			free(c);
+			return;
 		}
 	}
+}
 
-	wid = wm_get_focus();
-	if (wid != scrn->root) {
-		curwid = wid;
-		paint(wid);
+/*
+ * Query the server for the window geometry and map state, and record them
+ * in the window table. Both requests are sent before waiting on any reply,
+ * so this costs a single round trip.
+ */
+struct client_t *
+client_fetch(xcb_window_t wid)
+{
+	struct client_t *c = NULL;
+	xcb_get_geometry_cookie_t gc;
+	xcb_get_window_attributes_cookie_t ac;
+	xcb_get_geometry_reply_t *g;
+	xcb_get_window_attributes_reply_t *a;
+
+	gc = xcb_get_geometry(conn, wid);
+	ac = xcb_get_window_attributes(conn, wid);
+	g = xcb_get_geometry_reply(conn, gc, NULL);
+	a = xcb_get_window_attributes_reply(conn, ac, NULL);
+
+	if (g && a && (c = client_add(wid))) {
+		c->x = g->x;
+		c->y = g->y;
+		c->w = g->width;
+		c->h = g->height;
+		c->b = g->border_width;
+		c->d = g->depth;
+		c->mapped = a->map_state == XCB_MAP_STATE_VIEWABLE;
+		c->ignored = a->override_redirect;
+		edges_update(c);
 	}
 
-	return n;
+	free(g);
+	free(a);
+
+	return c;
 }
 
 /*
- * Draws a rectangle selection on the screen.
- * The trick here is to invert the color on the selection, so that
- * redrawing the same rectangle will "clear" it.
- * This function is used to dynamically draw a region for moving/resizing
- * a window using the cursor. As such, we need to make sure that whenever
- * we draw a rectangle, we clear out the last drawn one by redrawing
- * the latest coordinates again, so we have to save them from one call to
- * the other.
+ * Drop-in replacement for wm_get_attribute() reading from the window
+ * table. In debug mode (-d), every lookup is checked against the server
+ * and mismatches are reported.
  */
 int
-outline(xcb_drawable_t wid, int x, int y, int w, int h)
+getattr(xcb_window_t wid, int attr)
 {
-	int mask, val[3];
-	static int X = 0, Y = 0, W = 0, H = 0;
-	xcb_gcontext_t gc;
-	xcb_rectangle_t r;
+	int v, s;
+	struct client_t *c;
+
+	/* depth is not reported by XCB_CREATE_NOTIFY */
+	c = client(wid);
+	if (!c || (attr == ATTR_D && !c->d))
+		c = client_fetch(wid);
 
-	gc = xcb_generate_id(conn);
-	mask = XCB_GC_FUNCTION | XCB_GC_SUBWINDOW_MODE | XCB_GC_GRAPHICS_EXPOSURES;
-	val[0] = XCB_GX_INVERT;
-	val[1] = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS,
-	val[2] = 0;
-	xcb_create_gc(conn, gc, wid, mask, val);
+	if (!c)
+		return -1;
 
-	/* redraw last rectangle to clear it */
-	r.x = X;
-	r.y = Y;
-	r.width = W;
-	r.height = H;
-	xcb_poly_rectangle(conn, wid, gc, 1, &r);
+	switch (attr) {
+	case ATTR_X: v = c->x; break;
+	case ATTR_Y: v = c->y; break;
+	case ATTR_W: v = c->w; break;
+	case ATTR_H: v = c->h; break;
+	case ATTR_B: v = c->b; break;
+	case ATTR_D: v = c->d; break;
+	case ATTR_M: v = c->mapped; break;
+	case ATTR_I: v = c->ignored; break;
+	default:
+		return wm_get_attribute(wid, attr);
+	}
 
-	/* draw rectangle and save its coordinates for later removal */
-	X = r.x = x;
-	Y = r.y = y;
-	W = r.width = w;
-	H = r.height = h;
-	xcb_poly_rectangle(conn, wid, gc, 1, &r);
+	if (debug && (s = wm_get_attribute(wid, attr)) != v)
+		fprintf(stderr, "cache mismatch 0x%08x: attribute %d is %d, server says %d\n",
+			wid, attr, v, s);
 
-	return 0;
+	return v;
 }
 
 /*
- * Callback used for all events that are not explicitely registered.
- * This is not at all necessary, and used for debugging purposes.
+ * Wrappers around the libwm functions changing a window geometry, which
+ * update the window table right away. The matching XCB_CONFIGURE_NOTIFY
+ * will arrive later, but callers might need the new values before that.
  */
 int
-cb_default(xcb_generic_event_t *ev)
+teleport(xcb_window_t wid, int x, int y, int w, int h)
 {
-	if (verbose < 2)
-		return 0;
-
-	if (XEV(ev)) {
-		fprintf(stderr, "%s not handled\n", XEV(ev));
-	} else {
-		fprintf(stderr, "EVENT %d not handled\n", ev->response_type);
+	int r, resized = 0;
+	struct client_t *c;
+
+	if ((c = client(wid))) {
+		resized = (c->w != w || c->h != h);
+		c->x = x;
+		c->y = y;
+		c->w = w;
+		c->h = h;
 	}
 
-	return 0;
+	r = wm_teleport(wid, x, y, w, h);
+	if (resized && !c->ignored)
+		sample_later(c);
+
+	return r;
+}
+
+int
+setborder(xcb_window_t wid, int width, int color)
+{
+	struct client_t *c;
+
+	if ((c = client(wid)))
+		c->b = width;
+
+	return wm_set_border(width, color, wid);
 }
 
 /*
- * XCB_CREATE_NOTIFY is the first event triggered by new windows, and
- * is used to prepare the window for use by the WM.
- * The attribute `override_redirect` allow windows to specify that they
- * shouldn't be handled by the WM.
+ * Every window that shouldn't be ignored (override_redirect) is adoped
+ * by the WM when it is created, or when the WM is started.
+ * When a window is created, it is centered on the cursor, before it
+ * gets mapped on screen. Windows that are already visible are not moved.
+ * Some events are also registered by the WM for these windows.
  */
 int
-cb_create(xcb_generic_event_t *ev)
+adopt(xcb_window_t wid)
 {
-	int x, y, w, h;
-	xcb_randr_monitor_info_t *m;
-	xcb_create_notify_event_t *e;
+	if (getattr(wid, ATTR_I))
+		return -1;
 
-	e = (xcb_create_notify_event_t *)ev;
+	subscribe(wid);
+	hints_fetch(wid);
 
-	if (e->override_redirect)
-		return 0;
+	return 0;
+}
 
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->window);
+void
+subscribe(xcb_window_t wid)
+{
+	uint32_t mask;
 
-	x = wm_get_attribute(e->window, ATTR_X);
-	y = wm_get_attribute(e->window, ATTR_Y);
+	/* errors are reported as events, no need to wait for a reply */
+	mask = XCB_EVENT_MASK_ENTER_WINDOW
+		| XCB_EVENT_MASK_FOCUS_CHANGE
+		| XCB_EVENT_MASK_PROPERTY_CHANGE
+		| XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+	xcb_change_window_attributes(conn, wid, XCB_CW_EVENT_MASK, &mask);
+}
 
-	if (!wm_is_mapped(e->window) && !x && !y) {
-		wm_get_cursor(0, scrn->root, &x, &y);
+/*
+ * Sample the color of the pixels in the window corners. The pixels are
+ * read by the worker thread, and the color is applied by worker_apply()
+ * once known, so that the event loop never waits for it.
+ * Windows are sampled when they get mapped or resized, as their content
+ * is unlikely to change otherwise, see sample_later(). When following
+ * windows content, they are also sampled when their corners are drawn
+ * over, see cb_damage().
+ */
+int
+sample(xcb_window_t wid)
+{
+	struct job_t j;
+	struct client_t *c;
 
-		/* move window under the cursor */
-		if ((m = wm_get_monitor(wm_find_monitor(x, y)))) {
-			w = wm_get_attribute(e->window, ATTR_W);
-			h = wm_get_attribute(e->window, ATTR_H);
-			x = MAX(m->x, x - w/2);
-			y = MAX(m->y, y - h/2);
+	/* ignored windows have no border, eg. the outline, see outline() */
+	if (!(c = client(wid)) || c->ignored || !c->mapped || c->w < 1 || c->h < 1)
+		return -1;
 
-			wm_teleport(e->window, x, y, w, h);
+	memset(&j, 0, sizeof(j));
+	j.type = JOB_SAMPLE;
+	j.wid = wid;
+	j.w = c->w;
+	j.h = c->h;
+
+	if (xdamage) {
+		if (!c->damage) {
+			c->damage = xcb_generate_id(conn);
+			xcb_damage_create(conn, c->damage, wid,
+				XCB_DAMAGE_REPORT_LEVEL_BOUNDING_BOX);
 		}
+		/*
+		 * Cleared from this connection, which the damage object
+		 * belongs to, as the server doesn't order requests across
+		 * connections. Drawing done before the corners are read is
+		 * reported again at worst.
+		 */
+		xcb_damage_subtract(conn, c->damage, XCB_NONE, XCB_NONE);
+		if (c->dirty)
+			damage_cancel(c);
+		c->sampled = now();
 	}
 
-	adopt(e->window);
+	/* a sample still in progress gets superseded by this one */
+	if (!++samplegen)
+		samplegen++;
+	c->sampling = j.gen = samplegen;
+	worker_push(&j);
 
 	return 0;
 }
 
 /*
- * XCB_MAP_REQUEST is triggered by a window that wants to be mapped on
- * screen. This is then the responsibility of the WM to map it on screen
- * and eventually decorate it. This event require that the WM register
- * XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT on the root window to intercept
- * map requests.
+ * Right after a window is mapped or resized, its corners mostly hold
+ * the window background, or whatever was there before, as the client
+ * didn't repaint it yet. It is only sampled damage_interval later, to
+ * give the client time to draw.
  */
-int
-cb_mapreq(xcb_generic_event_t *ev)
+void
+sample_later(struct client_t *c)
 {
-	xcb_map_request_event_t *e;
+	c->sampled = now();
+	if (c->dirty)
+		return;
 
-	e = (xcb_map_request_event_t *)ev;
+	c->dirty = 1;
+	c->dnext = damaged;
+	damaged = c;
+}
+
+/*
+ * Following windows content is opt-in, as the server then reports every
+ * drawing done in them.
+ */
+void
+damage_init()
+{
+	xdamage = xcb_get_extension_data(conn, &xcb_damage_id);
+	if (!xdamage || !xdamage->present) {
+		fprintf(stderr, "DAMAGE extension missing, windows content will not be followed\n");
+		xdamage = NULL;
+		return;
+	}
+
+	xcb_discard_reply(conn, xcb_damage_query_version(conn,
+		XCB_DAMAGE_MAJOR_VERSION, XCB_DAMAGE_MINOR_VERSION).sequence);
+}
+
+/*
+ * Remove a window from the list of damaged ones.
+ */
+void
+damage_cancel(struct client_t *c)
+{
+	struct client_t **p;
+
+	for (p = &damaged; *p; p = &(*p)->dnext) {
+		if (*p == c) {
+			*p = c->dnext;
+			break;
+		}
+	}
+
+	c->dirty = 0;
+	c->dnext = NULL;
+}
+
+/*
+ * Return the time in milliseconds until the next window is due for a
+ * sample, or -1 if none is.
+ */
+int
+damage_timeout()
+{
+	long t, due = -1;
+	struct client_t *c;
+
+	t = now();
+	for (c = damaged; c; c = c->dnext)
+		if (due < 0 || c->sampled + damage_interval - t < due)
+			due = MAX(c->sampled + damage_interval - t, 0);
+
+	return due;
+}
+
+/*
+ * Sample the damaged windows again, once damage_interval went by since
+ * their last sample. Return the number of windows sampled.
+ */
+int
+damage_flush()
+{
+	int n = 0;
+	long t;
+	struct client_t *c, *next;
+
+	t = now();
+	for (c = damaged; c; c = next) {
+		next = c->dnext;
+		if (t - c->sampled < damage_interval)
+			continue;
+
+		damage_cancel(c);
+		sample(c->wid);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Queues are lock-free, as each end is only ever moved by one thread:
+ * the producer publishes an entry by moving the head past it, and the
+ * consumer gives it back by moving the tail.
+ * Return -1 if the queue is full (resp. empty), 0 otherwise.
+ */
+int
+ring_push(struct ring_t *r, struct job_t *j)
+{
+	unsigned int head, tail;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head - tail == LEN(r->job))
+		return -1;
+
+	r->job[head % LEN(r->job)] = *j;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+int
+ring_pop(struct ring_t *r, struct job_t *j)
+{
+	unsigned int head, tail;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (head == tail)
+		return -1;
+
+	*j = r->job[tail % LEN(r->job)];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	return 0;
+}
+
+/*
+ * Start the worker thread, over a connection of its own. Each end of the
+ * queues is signalled through a pipe, so that the worker can sleep until
+ * jobs come in, and the event loop can poll for results along with the
+ * X connection.
+ * Corners are read through shared memory when the server supports
+ * MIT-SHM, which saves copying pixels in the replies.
+ */
+int
+worker_init()
+{
+	int i, id;
+	void *p;
+	pthread_t t;
+	xcb_generic_error_t *err;
+	const xcb_query_extension_reply_t *ext;
+
+	wconn = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(wconn)) {
+		fprintf(stderr, "Cannot open the worker connection.\n");
+		return -1;
+	}
+
+	if (pipe(jobfd) < 0 || pipe(resfd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	/* only the worker end of the jobs pipe blocks */
+	for (i = 0; i < 2; i++) {
+		fcntl(jobfd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(resfd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(resfd[i], F_SETFL, O_NONBLOCK);
+	}
+	fcntl(jobfd[1], F_SETFL, O_NONBLOCK);
+
+	ext = xcb_get_extension_data(wconn, &xcb_shm_id);
+	if (ext && ext->present
+	 && (id = shmget(IPC_PRIVATE, LEN(batch) * 16, IPC_CREAT | 0600)) >= 0) {
+		if ((p = shmat(id, NULL, 0)) != (void *)-1) {
+			shmseg = xcb_generate_id(wconn);
+			err = xcb_request_check(wconn,
+				xcb_shm_attach_checked(wconn, shmseg, id, 0));
+			if (err) {
+				/* most likely a remote server */
+				free(err);
+				shmdt(p);
+			} else {
+				shmbuf = p;
+			}
+		}
+
+		/* the segment goes away once both processes detached from it */
+		shmctl(id, IPC_RMID, NULL);
+	}
+
+	if ((errno = pthread_create(&t, NULL, worker, NULL))) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(t);
+
+	return 0;
+}
+
+/*
+ * The worker thread sends queries that nothing waits on over its own
+ * connection, so that their replies, GetImage ones in particular, never
+ * hold up the events and replies the event loop needs.
+ * Jobs are taken in batches, whose requests are all sent before waiting
+ * on any reply, and results are posted once the whole batch is done.
+ * Nothing else than the worker connection and the queues is touched
+ * here, the window table belongs to the event loop.
+ */
+void *
+worker(void *arg)
+{
+	int i, n;
+	char buf[64];
+	ssize_t r;
+	unsigned int seq[LEN(batch)][4];
+	struct timespec ts = { 0, 1000000 };
+
+	(void)arg;
+
+	for (;;) {
+		if ((r = read(jobfd[0], buf, sizeof(buf))) == 0)
+			break;
+		if (r < 0 && errno != EINTR)
+			break;
+
+		do {
+			for (n = 0; n < (int)LEN(batch); n++)
+				if (ring_pop(&jobs, &batch[n]) < 0)
+					break;
+
+			for (i = 0; i < n; i++)
+				worker_send(&batch[i], i, seq[i]);
+			xcb_flush(wconn);
+
+			for (i = 0; i < n; i++) {
+				worker_recv(&batch[i], i, seq[i]);
+				/* the event loop empties it on the next wake up */
+				while (ring_push(&results, &batch[i]) < 0) {
+					r = write(resfd[1], "", 1);
+					nanosleep(&ts, NULL);
+				}
+			}
+
+			if (n)
+				r = write(resfd[1], "", 1);
+		} while (n == (int)LEN(batch));
+	}
+
+	return NULL;
+}
+
+/*
+ * Send the requests for a job, which is the `slot`th of its batch.
+ */
+void
+worker_send(struct job_t *j, int slot, unsigned int *seq)
+{
+	int n, x, y;
+
+	switch (j->type) {
+	case JOB_SAMPLE:
+		/* top-left, top-right, bottom-left, bottom-right */
+		for (n = 0; n < 4; n++) {
+			x = (n & 1) ? j->w - 1 : 0;
+			y = (n & 2) ? j->h - 1 : 0;
+			if (shmbuf)
+				seq[n] = xcb_shm_get_image(wconn, j->wid, x, y,
+					1, 1, 0xffffffff, XCB_IMAGE_FORMAT_Z_PIXMAP,
+					shmseg, (slot * 4 + n) * 4).sequence;
+			else
+				seq[n] = xcb_get_image(wconn, XCB_IMAGE_FORMAT_Z_PIXMAP,
+					j->wid, x, y, 1, 1, 0xffffffff).sequence;
+		}
+		break;
+	case JOB_HINTS:
+		seq[0] = xcb_get_property(wconn, 0, j->wid,
+			XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS,
+			0, 18).sequence;
+		break;
+	}
+}
+
+/*
+ * Collect the replies for a job, and fill in its result.
+ * Sampled corners are tested in a clockwise fashion until an uncovered
+ * region is found, and its color is saved as the window background.
+ * Windows are often gone or unmapped by the time their job comes, so
+ * errors are collected along with the replies, as nothing ever reads
+ * the events queue of this connection.
+ */
+void
+worker_recv(struct job_t *j, int slot, unsigned int *seq)
+{
+	int n;
+	xcb_image_t *px;
+	xcb_get_image_cookie_t ick;
+	xcb_get_image_reply_t *img;
+	xcb_shm_get_image_cookie_t sck;
+	xcb_shm_get_image_reply_t *shm;
+	xcb_get_property_cookie_t pck;
+	xcb_get_property_reply_t *p;
+	xcb_generic_error_t *err;
+
+	switch (j->type) {
+	case JOB_SAMPLE:
+		j->found = 0;
+		j->color = 0;
+		for (n = 0; n < 4; n++) {
+			px = NULL;
+			if (shmbuf) {
+				/* the pixels were written in the slot, not the reply */
+				sck.sequence = seq[n];
+				if ((shm = xcb_shm_get_image_reply(wconn, sck, &err))) {
+					px = xcb_image_create_native(wconn, 1, 1,
+						XCB_IMAGE_FORMAT_Z_PIXMAP, shm->depth,
+						NULL, shm->size,
+						shmbuf + (slot * 4 + n) * 4);
+					free(shm);
+				}
+			} else {
+				/* the image takes ownership of the reply */
+				ick.sequence = seq[n];
+				if ((img = xcb_get_image_reply(wconn, ick, &err))) {
+					px = xcb_image_create_native(wconn, 1, 1,
+						XCB_IMAGE_FORMAT_Z_PIXMAP, img->depth,
+						img, xcb_get_image_data_length(img),
+						xcb_get_image_data(img));
+					if (!px)
+						free(img);
+				}
+			}
+
+			free(err);
+			if (!px)
+				continue;
+
+			if (!j->found) {
+				j->color = xcb_image_get_pixel(px, 0, 0);
+				j->found = 1;
+			}
+
+			xcb_image_destroy(px);
+		}
+		break;
+	case JOB_HINTS:
+		/* parenthesized to keep it out of the statistics, see STATS */
+		pck.sequence = seq[0];
+		p = (xcb_get_property_reply)(wconn, pck, &err);
+		hints_parse(&j->hints, p);
+		free(err);
+		free(p);
+		break;
+	}
+}
+
+/*
+ * Queue a job for the worker, which only gets woken up by worker_kick()
+ * at the end of the events batch. When the queue is full, results are
+ * applied while waiting for room, as the worker might itself be waiting
+ * for room to post them.
+ */
+void
+worker_push(struct job_t *j)
+{
+	struct timespec ts = { 0, 1000000 };
+
+	while (ring_push(&jobs, j) < 0) {
+		worker_kick();
+		worker_apply(1);
+		nanosleep(&ts, NULL);
+	}
+
+	queued++;
+	inflight++;
+}
+
+/*
+ * Wake the worker up if jobs were queued since the last time. The main
+ * connection is flushed first, so that the damage cleared by sample()
+ * most likely reaches the server before the corners are read.
+ */
+void
+worker_kick()
+{
+	if (!queued)
+		return;
+
+	xcb_flush(conn);
+	if (write(jobfd[1], "", 1) < 0 && errno != EAGAIN)
+		perror("worker");
+	queued = 0;
+}
+
+/*
+ * Apply the results posted by the worker, and repaint the windows whose
+ * background color changed if `redraw` is set. Results for windows that
+ * were sampled again or unmapped in the meantime are dropped.
+ * Return the number of results applied.
+ */
+int
+worker_apply(int redraw)
+{
+	int n = 0;
+	char buf[64];
+	struct job_t r;
+	struct client_t *c;
+
+	while (read(resfd[0], buf, sizeof(buf)) > 0)
+		;
+
+	while (!ring_pop(&results, &r)) {
+		n++;
+		inflight--;
+		if (!(c = client(r.wid)))
+			continue;
+
+		switch (r.type) {
+		case JOB_SAMPLE:
+			if (c->sampling != r.gen)
+				break;
+			c->sampling = 0;
+			if (r.found && c->bg != r.color) {
+				c->bg = r.color;
+				if (redraw)
+					paint(c->wid);
+			}
+			break;
+		case JOB_HINTS:
+			c->hints = r.hints;
+			break;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Hand the jobs queued during the events batch over to the worker, and
+ * apply the results it posted. Return the number of results applied.
+ */
+int
+worker_flush()
+{
+	worker_kick();
+	return worker_apply(1);
+}
+
+/*
+ * Wait until the worker is done with all the jobs queued so far. This
+ * is only done when taking over, so that windows are decorated once and
+ * for all.
+ */
+void
+worker_settle()
+{
+	struct pollfd pfd;
+
+	worker_kick();
+
+	pfd.fd = resfd[0];
+	pfd.events = POLLIN;
+	while (inflight > 0) {
+		poll(&pfd, 1, -1);
+		worker_apply(0);
+	}
+}
+
+/*
+ * Return the color sampled from the window corners.
+ * If no color is found a default of border_color is returned.
+ */
+uint32_t
+backpixel(xcb_window_t wid)
+{
+	struct client_t *c;
+
+	if ((c = client(wid)))
+		return c->bg;
+
+	return border_color;
+}
+
+/*
+ * Render double borders in a pixmap of the window's size. The background
+ * is filled with `bg`, and the border line is drawn on top of it using
+ * the colors defined in config.h.
+ *
+ * Note: drawing on the borders require specifying regions from position
+ * the top-left corner of the window itself. Drawing on the border pixmap
+ * is done by drawing outside the window, and then wrapping over to the
+ * left side. For example, assuming a window of 200x100, with a 10px
+ * border, drawing a 5px square in the top left of the border means drawing
+ * a 5x5 rectangle at position 210,110. The area does not wrap around
+ * indefinitely though, so drawing a rectangle of 10x10 or 200x10 at
+ * position 210,110 would have the same effect: draw a 10x10 square in
+ * the top right. uugh…
+ */
+void
+render(xcb_pixmap_t px, xcb_gcontext_t gc, struct border_t *k)
+{
+	int w, h, b, i;
+	uint32_t val[1];
+
+	w = k->w;
+	h = k->h;
+	b = k->b;
+	i = k->i;
+
+	val[0] = k->bg;
+	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, val);
+
+	/* background color */
+	xcb_rectangle_t bg = { 0, 0, w + 2*b, h + 2*b };
+
+	xcb_poly_fill_rectangle(conn, px, gc, 1, &bg);
+
+	val[0] = k->focused ? border_color_active : border_color;
+	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, val);
+
+	/* abandon all hopes already */
+	xcb_rectangle_t r[] = {
+		{w+(b-i)/2,0,i,h+(b+i)/2},             /* right */
+		{w+b+(b-i)/2,0,i,h+(b+i)/2},           /* left */
+		{0,h+(b-i)/2,w+(b-i)/2+i,i},           /* bottom; bottom-right */
+		{0,h+b+(b-i)/2,w+(b+i)/2,i},           /* top; top-right */
+		{w+b+(b-i)/2,h+b+(b-i)/2,i+(b-i/2),i}, /* top-left corner; top-part */
+		{w+b+(b-i)/2,h+b+(b-i)/2,i,i+(b-i/2)}, /* top-left corner; left-part */
+		{w+b+(b-i)/2,h+(b-i)/2,i+(b-i)/2,i},   /* top-right corner; right-part */
+		{w+(b-i)/2,h+b+(b-i)/2,i,i+(b-i)/2}    /* bottom-left corner; bottom-part */
+	};
+
+	xcb_poly_fill_rectangle(conn, px, gc, 8, r);
+}
+
+/*
+ * Return the graphic context used to draw on pixmaps of the given depth.
+ * They are created once, as the foreground color is changed before any
+ * drawing anyway.
+ */
+xcb_gcontext_t
+getgc(xcb_drawable_t drawable, int depth)
+{
+	size_t n;
+	static struct {
+		int depth;
+		xcb_gcontext_t gc;
+	} gcs[8];
+
+	for (n = 0; n < LEN(gcs) && gcs[n].gc; n++)
+		if (gcs[n].depth == depth)
+			return gcs[n].gc;
+
+	/* too many depths in use, recycle the last slot */
+	if (n == LEN(gcs)) {
+		n--;
+		xcb_free_gc(conn, gcs[n].gc);
+	}
+
+	gcs[n].depth = depth;
+	gcs[n].gc = xcb_generate_id(conn);
+	xcb_create_gc(conn, gcs[n].gc, drawable, 0, NULL);
+
+	return gcs[n].gc;
+}
+
+/*
+ * Return a border pixmap matching the given key. Pixmaps are kept in a
+ * bounded cache, so that windows of the same size, or the same window
+ * painted over and over as the focus changes, share a single pixmap.
+ * When the cache is full, the least recently used pixmap is freed. The
+ * server keeps it alive for as long as windows use it as their border.
+ */
+xcb_pixmap_t
+getpixmap(xcb_window_t wid, struct border_t *k)
+{
+	size_t n, lru = 0;
+	struct border_t *p;
+	static unsigned long tick = 0;
+
+	for (n = 0; n < LEN(borders); n++) {
+		p = &borders[n];
+		if (p->px && p->w == k->w && p->h == k->h && p->d == k->d
+		 && p->b == k->b && p->i == k->i
+		 && p->focused == k->focused && p->bg == k->bg) {
+			p->used = ++tick;
+			pxstats.hits++;
+			return p->px;
+		}
+		if (p->used < borders[lru].used)
+			lru = n;
+	}
+
+	pxstats.misses++;
+	p = &borders[lru];
+	if (p->px) {
+		xcb_free_pixmap(conn, p->px);
+		pxstats.evictions++;
+	}
+
+	*p = *k;
+	p->used = ++tick;
+	p->px = xcb_generate_id(conn);
+	xcb_create_pixmap(conn, k->d, p->px, wid, k->w + 2*k->b, k->h + 2*k->b);
+	render(p->px, getgc(p->px, k->d), k);
+
+	if (verbose > 1)
+		fprintf(stderr, "Border cache miss %dx%d (%lu hits, %lu misses, %lu evictions)\n",
+			k->w, k->h, pxstats.hits, pxstats.misses, pxstats.evictions);
+
+	return p->px;
+}
+
+/*
+ * Paint double borders around the window. The background is taken from
+ * the window content via backpixel(), and the border line is drawn using
+ * the colors defined in config.h.
+ * Windows whose border pixmap would take more than border_pixmap_max
+ * pixels get a plain border of the line color instead, which takes no
+ * memory at all on the server. A pixmap only a few lines high, tiled by
+ * the server, would cost little too, but the side borders then repeat
+ * the top and bottom lines, and the corners can't be drawn right.
+ */
+int
+paint(xcb_window_t wid)
+{
+	struct border_t k;
+	xcb_pixmap_t px;
+	uint32_t val;
+
+	k.w = getattr(wid, ATTR_W);
+	k.h = getattr(wid, ATTR_H);
+	k.d = getattr(wid, ATTR_D);
+	k.b = getattr(wid, ATTR_B);
+	k.i = inner_border;
+
+	if (k.i > k.b || k.w < 0 || k.h < 0 || k.d < 0)
+		return -1;
+
+	if ((long)(k.w + 2*k.b) * (k.h + 2*k.b) > border_pixmap_max) {
+		val = wid == focuswid ? border_color_active : border_color;
+		xcb_change_window_attributes(conn, wid, XCB_CW_BORDER_PIXEL, &val);
+		return 0;
+	}
+
+	k.focused = (wid == focuswid);
+	k.bg = backpixel(wid);
+	k.px = XCB_NONE;
+	k.used = 0;
+
+	px = getpixmap(wid, &k);
+	xcb_change_window_attributes(conn, wid, XCB_CW_BORDER_PIXMAP, &px);
+
+	return 0;
+}
+
+/*
+ * Inflating a window will grow it both vertically and horizontally in
+ * all 4 directions, thus making it look like it is inflating.
+ * The window can be "deflated" by providing a negative `step` value.
+ */
+int
+inflate(xcb_window_t wid, int step)
+{
+	int x, y, w, h, dw, dh;
+	struct client_t *c;
+
+	/* grow by at least one size increment, or nothing would change */
+	dw = dh = step;
+	if ((c = client(wid)) && (c->hints.flags & HINT_INC)) {
+		if (c->hints.incw > abs(step)) dw = step < 0 ? -c->hints.incw : c->hints.incw;
+		if (c->hints.inch > abs(step)) dh = step < 0 ? -c->hints.inch : c->hints.inch;
+	}
+
+	w = getattr(wid, ATTR_W) + dw;
+	h = getattr(wid, ATTR_H) + dh;
+	sizehint(wid, &w, &h);
+
+	x = getattr(wid, ATTR_X) - (w - getattr(wid, ATTR_W))/2;
+	y = getattr(wid, ATTR_Y) - (h - getattr(wid, ATTR_H))/2;
+
+	teleport(wid, x, y, w, h);
+	paint(wid);
+
+	return 0;
+}
+
+/*
+ * Most terminals can only be resized by a multiple of their character
+ * size, and some windows have a minimum or maximum size. These are
+ * given in the WM_NORMAL_HINTS property, that is read by the worker when
+ * the window is adopted and whenever it changes, so that the WM sends
+ * sizes that the client will accept as is, rather than having it ask for
+ * a corrected size right after.
+ */
+void
+hints_fetch(xcb_window_t wid)
+{
+	struct job_t j;
+
+	memset(&j, 0, sizeof(j));
+	j.type = JOB_HINTS;
+	j.wid = wid;
+	worker_push(&j);
+}
+
+/*
+ * Read WM_NORMAL_HINTS for hints_fetch(), from the worker thread.
+ * Missing base and minimum sizes default to each other, as specified by
+ * the ICCCM.
+ */
+void
+hints_parse(struct hints_t *h, xcb_get_property_reply_t *p)
+{
+	int n;
+	uint32_t *v;
+
+	memset(h, 0, sizeof(*h));
+
+	/* clients predating ICCCM 1.0 set 15 fields, without base size */
+	if (!p || (n = xcb_get_property_value_length(p) / 4) < 15)
+		return;
+
+	v = xcb_get_property_value(p);
+	h->flags = v[0];
+	if (n < 18)
+		h->flags &= ~HINT_BASE;
+
+	if (h->flags & HINT_MIN) {
+		h->minw = v[5];
+		h->minh = v[6];
+	}
+	if (h->flags & HINT_MAX) {
+		h->maxw = v[7];
+		h->maxh = v[8];
+	}
+	if (h->flags & HINT_INC) {
+		h->incw = v[9];
+		h->inch = v[10];
+	}
+	if (h->flags & HINT_BASE) {
+		h->basew = v[15];
+		h->baseh = v[16];
+	}
+
+	if (!(h->flags & HINT_BASE)) {
+		h->basew = h->minw;
+		h->baseh = h->minh;
+	}
+	if (!(h->flags & HINT_MIN)) {
+		h->minw = h->basew;
+		h->minh = h->baseh;
+	}
+}
+
+/*
+ * Adjust a size to the window's size hints: round it down to a whole
+ * number of increments, and keep it within the size limits. Windows
+ * without hints still can't be smaller than a pixel, which the server
+ * would refuse.
+ */
+int
+sizehint(xcb_window_t wid, int *w, int *h)
+{
+	struct client_t *c;
+	struct hints_t *s;
+
+	if (!(c = client(wid)) || !c->hints.flags) {
+		*w = MAX(*w, 1);
+		*h = MAX(*h, 1);
+		return 0;
+	}
+
+	s = &c->hints;
+
+	if (s->incw > 1 && *w > s->basew)
+		*w = s->basew + (*w - s->basew) / s->incw * s->incw;
+	if (s->inch > 1 && *h > s->baseh)
+		*h = s->baseh + (*h - s->baseh) / s->inch * s->inch;
+
+	if (s->maxw > 0) *w = MIN(*w, s->maxw);
+	if (s->maxh > 0) *h = MIN(*h, s->maxh);
+	*w = MAX(*w, MAX(1, s->minw));
+	*h = MAX(*h, MAX(1, s->minh));
+
+	return 0;
+}
+
+/*
+ * To snap windows to their neighbours while they are dragged, the
+ * edges of all mapped windows are kept in two arrays, one for vertical
+ * edges sorted by their X position, the other for horizontal edges
+ * sorted by their Y position. Each window has two edges in each array,
+ * along with their extent on the other axis.
+ * They are updated along with the window table, so finding the edges
+ * close to a position is only a matter of bisecting the array.
+ */
+void
+edges_del(struct client_t *c)
+{
+	int a, i, j;
+
+	if (!c->indexed)
+		return;
+
+	for (a = 0; a < 2; a++) {
+		for (i = j = 0; i < nedges; i++)
+			if (edges[a][i].wid != c->wid)
+				edges[a][j++] = edges[a][i];
+	}
+
+	nedges -= 2;
+	c->indexed = 0;
+}
+
+void
+edges_update(struct client_t *c)
+{
+	int a, i, k, lo, hi, mid;
+	void *p;
+	struct edge_t e[2][2];
+
+	edges_del(c);
+
+	if (!c->mapped || c->ignored)
+		return;
+
+	if (nedges + 2 > maxedges) {
+		k = maxedges ? maxedges * 2 : 64;
+		for (a = 0; a < 2; a++) {
+			if (!(p = realloc(edges[a], k * sizeof(*edges[a]))))
+				return;
+			edges[a] = p;
+		}
+		maxedges = k;
+	}
+
+	e[AXIS_X][0].pos = c->x;
+	e[AXIS_X][1].pos = c->x + c->w + 2*c->b;
+	e[AXIS_X][0].lo  = e[AXIS_X][1].lo = c->y;
+	e[AXIS_X][0].hi  = e[AXIS_X][1].hi = c->y + c->h + 2*c->b;
+	e[AXIS_Y][0].pos = c->y;
+	e[AXIS_Y][1].pos = c->y + c->h + 2*c->b;
+	e[AXIS_Y][0].lo  = e[AXIS_Y][1].lo = c->x;
+	e[AXIS_Y][0].hi  = e[AXIS_Y][1].hi = c->x + c->w + 2*c->b;
+
+	for (a = 0; a < 2; a++) {
+		for (k = 0; k < 2; k++) {
+			e[a][k].wid = c->wid;
+
+			for (lo = 0, hi = nedges + k; lo < hi;) {
+				mid = (lo + hi) / 2;
+				if (edges[a][mid].pos < e[a][k].pos)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			i = lo;
+			memmove(&edges[a][i + 1], &edges[a][i],
+				(nedges + k - i) * sizeof(*edges[a]));
+			edges[a][i] = e[a][k];
+		}
+	}
+
+	nedges += 2;
+	c->indexed = 1;
+}
+
+/*
+ * Return the distance from an edge of the window being dragged to the
+ * closest edge of another window, or of the monitor, along the given
+ * axis. Only the edges facing the dragged one within `snap` pixels are
+ * considered. If there is none, a distance greater than `snap` is
+ * returned.
+ */
+int
+snapedge(int axis, int pos, int lo, int hi, struct monitor_t *m)
+{
+	int i, d, l, h, mid, best = snap + 1;
+	struct edge_t *e = edges[axis];
+
+	for (l = 0, h = nedges; l < h;) {
+		mid = (l + h) / 2;
+		if (e[mid].pos < pos - snap)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+
+	for (i = l; i < nedges && e[i].pos <= pos + snap; i++) {
+		if (e[i].wid == curwid || e[i].hi < lo || e[i].lo > hi)
+			continue;
+		d = e[i].pos - pos;
+		if (abs(d) < abs(best))
+			best = d;
+	}
+
+	if (m) {
+		d = (axis == AXIS_X ? m->x : m->y) - pos;
+		if (abs(d) < abs(best))
+			best = d;
+		d = (axis == AXIS_X ? m->x + m->w : m->y + m->h) - pos;
+		if (abs(d) < abs(best))
+			best = d;
+	}
+
+	return best;
+}
+
+/*
+ * Compute the geometry of the window being moved (button 1), teleported
+ * (button 2) or resized (button 3) from the pointer position. The edges
+ * that move along with the pointer are snapped to nearby edges, so that
+ * windows can easily be placed side by side, and the size is made to
+ * match the window's size hints.
+ * Return -1 for any other button.
+ */
+int
+dragrect(int button, int rx, int ry, int *x, int *y, int *w, int *h)
+{
+	int b, d, d1;
+	struct monitor_t *m;
+
+	switch (button) {
+	case 1:
+		*x = rx - cursor.x;
+		*y = ry - cursor.y;
+		*w = getattr(curwid, ATTR_W);
+		*h = getattr(curwid, ATTR_H);
+		break;
+	case 2:
+		*x = MIN(cursor.x, rx);
+		*y = MIN(cursor.y, ry);
+		*w = MAX(cursor.x, rx) - *x;
+		*h = MAX(cursor.y, ry) - *y;
+		break;
+	case 3:
+		*x = getattr(curwid, ATTR_X);
+		*y = getattr(curwid, ATTR_Y);
+		*w = rx - *x;
+		*h = ry - *y;
+		break;
+	default:
+		return -1;
+	}
+
+	/* moved windows keep their size */
+	if (!snap)
+		return button == 1 ? 0 : sizehint(curwid, w, h);
+
+	b = 2 * getattr(curwid, ATTR_B);
+	m = monitor(rx, ry);
+
+	/* moved windows snap by whichever edge is the closest */
+	if (button == 1) {
+		d  = snapedge(AXIS_X, *x, *y, *y + *h + b, m);
+		d1 = snapedge(AXIS_X, *x + *w + b, *y, *y + *h + b, m);
+		if (abs(d1) < abs(d)) d = d1;
+		if (abs(d) <= snap) *x += d;
+
+		d  = snapedge(AXIS_Y, *y, *x, *x + *w + b, m);
+		d1 = snapedge(AXIS_Y, *y + *h + b, *x, *x + *w + b, m);
+		if (abs(d1) < abs(d)) d = d1;
+		if (abs(d) <= snap) *y += d;
+
+		return 0;
+	}
+
+	/* when teleporting, the top-left corner follows the pointer too */
+	if (button == 2) {
+		d = snapedge(AXIS_X, *x, *y, *y + *h + b, m);
+		if (abs(d) <= snap) { *x += d; *w -= d; }
+		d = snapedge(AXIS_Y, *y, *x, *x + *w + b, m);
+		if (abs(d) <= snap) { *y += d; *h -= d; }
+	}
+
+	d = snapedge(AXIS_X, *x + *w + b, *y, *y + *h + b, m);
+	if (abs(d) <= snap) *w += d;
+	d = snapedge(AXIS_Y, *y + *h + b, *x, *x + *w + b, m);
+	if (abs(d) <= snap) *h += d;
+
+	return sizehint(curwid, w, h);
+}
+
+/*
+ * When the WM is started, it will take control of the existing windows.
+ * This means registering events on them and setting the borders if they
+ * are mapped. This function is only supposed to run once at startup,
+ * as the callback functions will take control of new windows
+ *
+ * There can be hundreds of windows to adopt, so the work is done in
+ * phases: the attributes and geometry of every window are requested
+ * first, then all replies are collected to fill the window table, and
+ * only then are the windows adopted and decorated. This way, the startup
+ * time doesn't grow with the number of windows times the round trip.
+ */
+int
+takeover()
+{
+	int i, n, adopted = 0;
+	struct client_t *c;
+	struct timespec t0, t1;
+	xcb_window_t *orphans = NULL, wid;
+	xcb_get_geometry_cookie_t *gc;
+	xcb_get_window_attributes_cookie_t *ac;
+	xcb_get_input_focus_cookie_t fc;
+	xcb_get_geometry_reply_t *g;
+	xcb_get_window_attributes_reply_t *a;
+	xcb_get_input_focus_reply_t *f;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	n = wm_get_windows(scrn->root, &orphans);
+	if (n < 0)
+		n = 0;
+
+	gc = calloc(n + 1, sizeof(*gc));
+	ac = calloc(n + 1, sizeof(*ac));
+	if (!gc || !ac) {
+		fprintf(stderr, "cannot allocate memory\n");
+		exit(1);
+	}
+
+	/* phase 1: send all requests */
+	for (i = 0; i < n; i++) {
+		ac[i] = xcb_get_window_attributes(conn, orphans[i]);
+		gc[i] = xcb_get_geometry(conn, orphans[i]);
+	}
+	fc = xcb_get_input_focus(conn);
+
+	/* phase 2: collect replies and fill the window table */
+	for (i = 0; i < n; i++) {
+		a = xcb_get_window_attributes_reply(conn, ac[i], NULL);
+		g = xcb_get_geometry_reply(conn, gc[i], NULL);
+
+		if (a && g && (c = client_add(orphans[i]))) {
+			c->x = g->x;
+			c->y = g->y;
+			c->w = g->width;
+			c->h = g->height;
+			c->b = g->border_width;
+			c->d = g->depth;
+			c->mapped = a->map_state == XCB_MAP_STATE_VIEWABLE;
+			c->ignored = a->override_redirect;
+			edges_update(c);
+		}
+
+		free(a);
+		free(g);
+	}
+
+	if ((f = xcb_get_input_focus_reply(conn, fc, NULL))) {
+		focuswid = f->focus;
+		free(f);
+	}
+
+	/* phase 3: adopt windows and sample their color */
+	for (i = 0; i < n; i++) {
+		wid = orphans[i];
+		if (!(c = client(wid)) || c->ignored)
+			continue;
+
+		if (verbose)
+			fprintf(stderr, "Adopting 0x%08x\n", wid);
+
+		adopt(wid);
+		adopted++;
+		if (c->mapped) {
+			setborder(wid, border, 0);
+			sample(wid);
+			ewmh_add(wid, 0);
+		}
+	}
+
+	/* windows are listed bottom to top, as the stacking order */
+	ewmh_publish(NET_CLIENT_LIST);
+	ewmh_publish(NET_CLIENT_LIST_STACKING);
+
+	/* phase 4: decorate windows once their color is known */
+	worker_settle();
+	for (i = 0; i < n; i++) {
+		if (!(c = client(orphans[i])) || c->ignored || !c->mapped)
+			continue;
+
+		paint(c->wid);
+	}
+
+	free(gc);
+	free(ac);
+	free(orphans);
+
+	wid = focuswid;
+	if (wid != scrn->root && client(wid)) {
+		curwid = wid;
+		paint(wid);
+	}
+
+	if (verbose) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		fprintf(stderr, "Adopted %d/%d windows in %.3f ms\n", adopted, n,
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	}
+
+	return n;
+}
+
+/*
+ * Restart in place, so that a new binary or config.h takes effect
+ * without going through takeover() again. The window table, focus and
+ * monitors are written to an unlinked temporary file, whose descriptor
+ * is handed over to the new process with -R. It is only called from
+ * the event loop once idle, and the work still in flight is completed
+ * first, so that nothing gets lost on the way.
+ */
+void
+restart()
+{
+	int i, n;
+	char fd[16], **av;
+	FILE *f;
+
+	while (pending) {
+		pending_step(pending, 1);
+		pending_run();
+	}
+	worker_settle();
+
+	if (!(f = tmpfile())) {
+		perror("tmpfile");
+		return;
+	}
+
+	state_save(f);
+	fflush(f);
+	lseek(fileno(f), 0, SEEK_SET);
+
+	/* same arguments, but the -R of the previous restart, if any */
+	for (n = 0; args[n]; n++);
+	if (!(av = calloc(n + 3, sizeof(*av)))) {
+		fclose(f);
+		return;
+	}
+	for (i = n = 0; args[i]; i++) {
+		if (!strcmp(args[i], "-R") && args[i + 1]) {
+			i++;
+			continue;
+		}
+		av[n++] = args[i];
+	}
+	snprintf(fd, sizeof(fd), "%d", fileno(f));
+	av[n++] = "-R";
+	av[n++] = fd;
+	av[n] = NULL;
+
+	if (verbose)
+		fprintf(stderr, "Restarting %s\n", av[0]);
+
+	xcb_flush(conn);
+	execvp(av[0], av);
+
+	perror(av[0]);
+	free(av);
+	fclose(f);
+}
+
+/*
+ * The state is written as text, one record per line, so that it doesn't
+ * depend on the layout of the structures, which may well differ in the
+ * new binary. Listed windows come first, in the order they were listed,
+ * followed by the stacking order.
+ */
+void
+state_save(FILE *f)
+{
+	int i;
+	size_t n;
+	struct client_t *c;
+	struct monitor_t *m;
+
+	fprintf(f, "glazier 1\n");
+	fprintf(f, "focus 0x%08x 0x%08x\n", focuswid, curwid);
+
+	for (i = 0; i < nmonitors; i++) {
+		m = &monitors[i];
+		fprintf(f, "monitor %d %d %d %d %u\n", m->x, m->y, m->w, m->h,
+			m->interval);
+	}
+
+	for (i = 0; i < nclist; i++)
+		if ((c = client(clist[i])))
+			state_client(f, c);
+
+	for (n = 0; n < LEN(clients); n++)
+		for (c = clients[n]; c; c = c->next)
+			if (!c->listed)
+				state_client(f, c);
+
+	for (i = 0; i < nclist; i++)
+		fprintf(f, "stack 0x%08x\n", slist[i]);
+}
+
+void
+state_client(FILE *f, struct client_t *c)
+{
+	struct hints_t *h = &c->hints;
+
+	fprintf(f, "client 0x%08x %d %d %d %d %d %d %d %d %d 0x%08x "
+		"%u %d %d %d %d %d %d %d %d\n",
+		c->wid, c->x, c->y, c->w, c->h, c->b, c->d,
+		c->mapped, c->ignored, c->listed, c->bg,
+		h->flags, h->minw, h->minh, h->maxw, h->maxh,
+		h->incw, h->inch, h->basew, h->baseh);
+}
+
+/*
+ * Fill the window table from the state saved by the previous process.
+ * This doesn't send anything to the server, see resume().
+ * Return -1 if the state can't be read, in which case the WM takes
+ * over the windows from scratch.
+ */
+int
+state_load(int fd)
+{
+	int k = 0, v;
+	int mapped, ignored, listed;
+	char line[256];
+	unsigned int wid, cur;
+	FILE *f;
+	struct client_t *c, t;
+	struct hints_t *h;
+	struct monitor_t *m;
+
+	if (!(f = fdopen(fd, "r"))) {
+		perror("state");
+		return -1;
+	}
+
+	if (!fgets(line, sizeof(line), f)
+	 || sscanf(line, "glazier %d", &v) != 1 || v != 1) {
+		fprintf(stderr, "state: unknown format\n");
+		fclose(f);
+		return -1;
+	}
+
+	h = &t.hints;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "focus %x %x", &wid, &cur) == 2) {
+			focuswid = wid;
+			curwid = cur;
+		} else if (!strncmp(line, "monitor ", 8)
+		        && nmonitors < (int)LEN(monitors)) {
+			m = &monitors[nmonitors];
+			if (sscanf(line, "monitor %d %d %d %d %u", &m->x, &m->y,
+			    &m->w, &m->h, &m->interval) == 5)
+				nmonitors++;
+		} else if (sscanf(line, "client %x %d %d %d %d %d %d %d %d %d %x "
+		           "%u %d %d %d %d %d %d %d %d", &wid,
+		           &t.x, &t.y, &t.w, &t.h, &t.b, &t.d,
+		           &mapped, &ignored, &listed, &t.bg,
+		           &h->flags, &h->minw, &h->minh, &h->maxw, &h->maxh,
+		           &h->incw, &h->inch, &h->basew, &h->baseh) == 20) {
+			if (!(c = client_add(wid)))
+				continue;
+			c->x = t.x;
+			c->y = t.y;
+			c->w = t.w;
+			c->h = t.h;
+			c->b = t.b;
+			c->d = t.d;
+			c->mapped = mapped;
+			c->ignored = ignored;
+			c->bg = t.bg;
+			c->hints = t.hints;
+			edges_update(c);
+			if (listed)
+				ewmh_add(wid, 0);
+		} else if (sscanf(line, "stack %x", &wid) == 1 && k < nclist) {
+			slist[k++] = wid;
+		}
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/*
+ * Take over from the window table handed over by the previous process,
+ * rather than querying every window and waiting for the replies like
+ * takeover() does. The events selected on the windows went away with
+ * the previous connection, and are selected again. The geometry and map
+ * state of each window are then checked as their replies come in, and
+ * windows that vanished in the meantime are dropped. Windows created
+ * while no WM was running are found from a single walk of the tree.
+ * Borders are left as they are, the server keeps them.
+ */
+int
+resume()
+{
+	int n = 0;
+	size_t i;
+	unsigned int seq[2];
+	struct client_t *c;
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < LEN(clients); i++) {
+		for (c = clients[i]; c; c = c->next, n++) {
+			if (!c->ignored)
+				subscribe(c->wid);
+			seq[0] = xcb_get_geometry(conn, c->wid).sequence;
+			seq[1] = xcb_get_window_attributes(conn, c->wid).sequence;
+			defer(c->wid, resume_check, 2, seq);
+
+			/* damage objects went away as well */
+			if (xdamage && c->mapped && !c->ignored)
+				sample(c->wid);
+		}
+	}
+
+	seq[0] = xcb_query_tree(conn, scrn->root).sequence;
+	defer(scrn->root, resume_tree, 1, seq);
+
+	ewmh_publish(NET_CLIENT_LIST);
+	ewmh_publish(NET_CLIENT_LIST_STACKING);
+
+	if (verbose) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		fprintf(stderr, "Resumed %d windows in %.3f ms\n", n,
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	}
+
+	return n;
+}
+
+/*
+ * Continuation of resume(), for each window of the table. Windows that
+ * got mapped meanwhile were not decorated, as nobody was there to
+ * handle their map request.
+ */
+void
+resume_check(xcb_window_t wid, void **r)
+{
+	int mapped;
+	struct client_t *c;
+	xcb_get_geometry_reply_t *g = r[0];
+	xcb_get_window_attributes_reply_t *a = r[1];
+
+	if (!(c = client(wid)))
+		return;
+
+	if (!g || !a) {
+		if (verbose)
+			fprintf(stderr, "Dropping 0x%08x\n", wid);
+		client_del(wid);
+		return;
+	}
+
+	c->x = g->x;
+	c->y = g->y;
+	c->w = g->width;
+	c->h = g->height;
+	c->b = g->border_width;
+
+	mapped = a->map_state == XCB_MAP_STATE_VIEWABLE;
+	if (mapped && !c->mapped) {
+		c->mapped = 1;
+		if (!c->ignored) {
+			setborder(wid, border, 0);
+			sample(wid);
+			ewmh_add(wid, 1);
+		}
+	} else if (!mapped && c->mapped) {
+		c->mapped = 0;
+		c->sampling = 0;
+		ewmh_del(wid);
+	}
+
+	edges_update(c);
+}
+
+/*
+ * Continuation of resume(): adopt the windows created while no WM was
+ * running. There shouldn't be many, so they are queried one by one.
+ */
+void
+resume_tree(xcb_window_t wid, void **r)
+{
+	int i, n;
+	xcb_window_t *w;
+	struct client_t *c;
+	xcb_query_tree_reply_t *t = r[0];
+
+	(void)wid;
+
+	if (!t)
+		return;
+
+	w = xcb_query_tree_children(t);
+	n = xcb_query_tree_children_length(t);
+	for (i = 0; i < n; i++) {
+		if (client(w[i]) || !(c = client_fetch(w[i])) || c->ignored)
+			continue;
+
+		if (verbose)
+			fprintf(stderr, "Adopting 0x%08x\n", w[i]);
+
+		adopt(w[i]);
+		if (c->mapped) {
+			setborder(w[i], border, 0);
+			sample(w[i]);
+			ewmh_add(w[i], 1);
+		}
+	}
+}
+
+/*
+ * Draws a rectangle selection on the screen.
+ * The rectangle is made of four thin override-redirect windows, one
+ * per side, created once and moved around for the WM lifetime. The X
+ * server takes care of exposing whatever they uncover, so there is
+ * nothing to clear or redraw when the selection moves or goes away.
+ * This function is used to dynamically draw a region for moving/resizing
+ * a window using the cursor. Passing an empty rectangle hides it.
+ */
+int
+outline(int x, int y, int w, int h)
+{
+	int i, mask;
+	uint32_t val[5];
+	static int shown = 0;
+	static xcb_window_t bar[4] = { 0 };
+
+	if (!bar[0]) {
+		mask = XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_SAVE_UNDER;
+		val[0] = border_color_active;
+		val[1] = 1;
+		val[2] = 1;
+		for (i = 0; i < 4; i++) {
+			bar[i] = xcb_generate_id(conn);
+			xcb_create_window(conn, XCB_COPY_FROM_PARENT, bar[i],
+				scrn->root, 0, 0, 1, 1, 0,
+				XCB_WINDOW_CLASS_INPUT_OUTPUT,
+				scrn->root_visual, mask, val);
+		}
+	}
+
+	if (!w && !h) {
+		if (shown)
+			for (i = 0; i < 4; i++)
+				xcb_unmap_window(conn, bar[i]);
+		shown = 0;
+		return 0;
+	}
+
+	w = MAX(w, 0);
+	h = MAX(h, 0);
+
+	/* top, bottom, left and right sides, in that order */
+	mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y
+	     | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT
+	     | XCB_CONFIG_WINDOW_STACK_MODE;
+	val[4] = XCB_STACK_MODE_ABOVE;
+	for (i = 0; i < 4; i++) {
+		val[0] = x + (i == 3 ? w : 0);
+		val[1] = y + (i == 1 ? h : 0);
+		val[2] = i < 2 ? w + 1 : 1;
+		val[3] = i < 2 ? 1 : h + 1;
+		xcb_configure_window(conn, bar[i], mask, val);
+		if (!shown)
+			xcb_map_window(conn, bar[i]);
+	}
+
+	dragging.requests += shown ? 4 : 8;
+	shown = 1;
+
+	return 0;
+}
+
+/*
+ * Load all the crosshairs defined in config.h at once, so that grabbing
+ * the pointer doesn't require reading cursor themes from disk, nor
+ * creating new cursors on the server every time.
+ */
+int
+getcursors()
+{
+	size_t i;
+	xcb_cursor_context_t *cx;
+
+	if (xcb_cursor_context_new(conn, scrn, &cx) < 0) {
+		fprintf(stderr, "cannot instantiate cursor\n");
+		return -1;
+	}
+
+	for (i = 0; i < LEN(xhair); i++)
+		if (xhair[i])
+			xcursor[i] = xcb_cursor_load_cursor(cx, xhair[i]);
+
+	xcb_cursor_context_free(cx);
+
+	return 0;
+}
+
+/*
+ * Grab the pointer to receive the given events until it is released,
+ * displaying one of the crosshairs meanwhile.
+ * There is nothing to do if the grab fails, so the reply is discarded
+ * rather than waited for.
+ */
+int
+grab(uint32_t mask, int xh)
+{
+	xcb_grab_pointer_cookie_t ck;
+
+	ck = xcb_grab_pointer(conn, 0, scrn->root, mask,
+		XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE,
+		xcursor[xh], XCB_CURRENT_TIME);
+	xcb_discard_reply(conn, ck.sequence);
+
+	return 0;
+}
+
+/*
+ * Callbacks must not wait for replies, or a single slow client would
+ * hold up the handling of all other events. Instead, they send their
+ * requests, and register the rest of their work as a continuation that
+ * is called with the replies once they all arrived, see pending_flush().
+ * Replies come in the order requests were sent, so continuations are
+ * kept in a FIFO, and called in that order.
+ */
+void
+defer(xcb_window_t wid, void (*cont)(xcb_window_t, void **), int n, unsigned int *seq)
+{
+	int i;
+	struct pending_t *p;
+
+	if (!(p = calloc(1, sizeof(*p)))) {
+		for (i = 0; i < n; i++)
+			xcb_discard_reply(conn, seq[i]);
+		return;
+	}
+
+	p->wid = wid;
+	p->cont = cont;
+	p->n = MIN(n, (int)LEN(p->seq));
+	for (i = 0; i < p->n; i++)
+		p->seq[i] = seq[i];
+
+	*pendtail = p;
+	pendtail = &p->next;
+}
+
+/*
+ * Collect the replies of a pending continuation, waiting for them if
+ * `block` is set. Failed requests get a NULL reply.
+ * Return 1 if all replies are there, 0 otherwise.
+ */
+int
+pending_step(struct pending_t *p, int block)
+{
+	void *r;
+	xcb_generic_error_t *err = NULL;
+
+	for (; p->got < p->n; p->got++) {
+		r = NULL;
+		if (block)
+			r = xcb_wait_for_reply(conn, p->seq[p->got], &err);
+		else if (!xcb_poll_for_reply(conn, p->seq[p->got], &r, &err))
+			return 0;
+
+		p->reply[p->got] = r;
+		free(err);
+		err = NULL;
+	}
+
+	return 1;
+}
+
+/*
+ * Remove the first continuation from the queue, and call it. Its replies
+ * must be there already.
+ */
+void
+pending_run()
+{
+	int i;
+	struct pending_t *p;
+
+	p = pending;
+	if (!(pending = p->next))
+		pendtail = &pending;
+
+	p->cont(p->wid, p->reply);
+
+	for (i = 0; i < p->n; i++)
+		free(p->reply[i]);
+	free(p);
+}
+
+/*
+ * Call all continuations whose replies arrived, without blocking.
+ * Return the number of continuations called.
+ */
+int
+pending_flush()
+{
+	int n = 0;
+
+	while (pending && pending_step(pending, 0)) {
+		pending_run();
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Some events require that the work started for a window is complete,
+ * eg. it must be placed before being mapped. Wait for all continuations
+ * up to the last one for this window, and call them.
+ */
+void
+pending_settle(xcb_window_t wid)
+{
+	struct pending_t *p, *last;
+
+	for (last = NULL, p = pending; p; p = p->next)
+		if (p->wid == wid)
+			last = p;
+
+	while (last && pending) {
+		p = pending;
+		pending_step(p, 1);
+		pending_run();
+		if (p == last)
+			break;
+	}
+}
+
+/*
+ * Clients supporting the _NET_WM_SYNC_REQUEST protocol expose an XSync
+ * counter that they update once they are done redrawing after a resize.
+ * When a window is about to be resized interactively, an alarm is set
+ * on this counter, so that XCB_SYNC_ALARM_NOTIFY tells when the client
+ * is ready for the next size, instead of flooding it with sizes it
+ * doesn't have time to draw.
+ * The window properties are read asynchronously, so the alarm only
+ * kicks in once the replies arrived. Until then, resizes are paced by
+ * the monitor refresh rate, see drag_flush().
+ * Return -1 if the window is known not to support the protocol, 0
+ * otherwise.
+ */
+int
+syncsetup(xcb_window_t wid)
+{
+	unsigned int seq[2];
+	struct client_t *c;
+
+	if (!xsync || !(c = client(wid)))
+		return -1;
+
+	if (c->synced)
+		return c->alarm ? 0 : -1;
+
+	c->synced = 1;
+	seq[0] = xcb_get_property(conn, 0, wid, atoms[WM_PROTOCOLS], XCB_ATOM_ATOM, 0, 32).sequence;
+	seq[1] = xcb_get_property(conn, 0, wid, atoms[NET_WM_SYNC_REQUEST_COUNTER], XCB_ATOM_CARDINAL, 0, 1).sequence;
+	defer(wid, sync_props, 2, seq);
+
+	return 0;
+}
+
+/*
+ * Continuation of syncsetup(), once the window properties are known:
+ * query the current value of the counter, if any.
+ */
+void
+sync_props(xcb_window_t wid, void **r)
+{
+	uint32_t i, n;
+	unsigned int seq;
+	xcb_atom_t *protos;
+	struct client_t *c;
+	xcb_get_property_reply_t *p = r[0], *q = r[1];
+
+	if (!(c = client(wid)))
+		return;
+
+	if (p && q && xcb_get_property_value_length(q) == 4) {
+		protos = xcb_get_property_value(p);
+		n = xcb_get_property_value_length(p) / 4;
+		for (i = 0; i < n; i++)
+			if (protos[i] == atoms[NET_WM_SYNC_REQUEST])
+				c->counter = *(xcb_sync_counter_t *)xcb_get_property_value(q);
+	}
+
+	if (!c->counter)
+		return;
+
+	seq = xcb_sync_query_counter(conn, c->counter).sequence;
+	defer(wid, sync_counter, 1, &seq);
+}
+
+/*
+ * Continuation of sync_props(), once the counter value is known: set an
+ * alarm to fire when the counter reaches the value the first sync
+ * request will carry, see syncrequest(). Armed against the current
+ * value, it would fire right away.
+ */
+void
+sync_counter(xcb_window_t wid, void **r)
+{
+	uint32_t val[6];
+	struct client_t *c;
+	xcb_sync_query_counter_reply_t *q = r[0];
+
+	if (!(c = client(wid)))
+		return;
+
+	if (!q) {
+		c->counter = XCB_NONE;
+		return;
+	}
+
+	c->syncval = ((int64_t)q->counter_value.hi << 32) | q->counter_value.lo;
+
+	c->alarm = xcb_generate_id(conn);
+	val[0] = c->counter;
+	val[1] = XCB_SYNC_VALUETYPE_ABSOLUTE;
+	val[2] = (c->syncval + 1) >> 32;
+	val[3] = (c->syncval + 1) & 0xffffffff;
+	val[4] = XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON;
+	val[5] = 1;
+	xcb_sync_create_alarm(conn, c->alarm, XCB_SYNC_CA_COUNTER
+		| XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_VALUE
+		| XCB_SYNC_CA_TEST_TYPE | XCB_SYNC_CA_EVENTS, val);
+
+	if (verbose)
+		fprintf(stderr, "Sync counter 0x%08x for 0x%08x\n", c->counter, wid);
+}
+
+/*
+ * Ask the client to update its sync counter once it has redrawn after
+ * the next resize, and set the alarm to fire when it does so.
+ * This must be sent right before the ConfigureWindow request.
+ */
+int
+syncrequest(struct client_t *c)
+{
+	uint32_t val[2];
+	xcb_client_message_event_t ev;
+
+	if (!c->alarm)
+		return -1;
+
+	c->syncval++;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.response_type = XCB_CLIENT_MESSAGE;
+	ev.format = 32;
+	ev.window = c->wid;
+	ev.type = atoms[WM_PROTOCOLS];
+	ev.data.data32[0] = atoms[NET_WM_SYNC_REQUEST];
+	ev.data.data32[1] = XCB_CURRENT_TIME;
+	ev.data.data32[2] = c->syncval & 0xffffffff;
+	ev.data.data32[3] = c->syncval >> 32;
+	xcb_send_event(conn, 0, c->wid, XCB_EVENT_MASK_NO_EVENT, (char *)&ev);
+
+	val[0] = c->syncval >> 32;
+	val[1] = c->syncval & 0xffffffff;
+	xcb_sync_change_alarm(conn, c->alarm, XCB_SYNC_CA_VALUE, val);
+
+	return 0;
+}
+
+/*
+ * Return a monotonic time in milliseconds.
+ */
+long
+now()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/*
+ * In opaque mode, the window itself is moved/resized while the pointer
+ * moves, instead of drawing an outline of its future geometry.
+ * To avoid flooding the server (and the client) with requests, at most
+ * one ConfigureWindow is in flight at any time, and no more than one is
+ * sent per frame. The latest geometry is saved, and sent by drag_flush()
+ * once the previous one has been applied, as reported by
+ * XCB_CONFIGURE_NOTIFY. Borders are only repainted on release.
+ */
+int
+drag(int x, int y, int w, int h)
+{
+	dragging.x = x;
+	dragging.y = y;
+	dragging.w = w;
+	dragging.h = h;
+	dragging.pending = 1;
+
+	return drag_flush();
+}
+
+/*
+ * Send the pending geometry of the window being dragged, if allowed to.
+ * Return 1 if a request was sent, 0 otherwise.
+ */
+int
+drag_flush()
+{
+	int resize;
+	long t, frame;
+	struct client_t *c;
+
+	if (!dragging.pending || !(c = client(curwid)))
+		return 0;
+
+	t = now();
+	frame = interval(c->x + c->w/2, c->y + c->h/2, 16);
+
+	/*
+	 * don't wait forever for a notification that won't come. Clients
+	 * implementing _NET_WM_SYNC_REQUEST are given more time to redraw.
+	 */
+	if (dragging.inflight && t - dragging.sent < (dragging.syncing ? 250 : 4 * frame))
+		return 0;
+
+	if (t - dragging.sent < frame)
+		return 0;
+
+	dragging.pending = 0;
+	if (dragging.x == c->x && dragging.y == c->y
+	 && dragging.w == c->w && dragging.h == c->h)
+		return 0;
+
+	resize = (dragging.w != c->w || dragging.h != c->h);
+	if (resize)
+		dragging.resized = 1;
+
+	/*
+	 * The window table is updated directly, so that the resulting
+	 * XCB_CONFIGURE_NOTIFY doesn't trigger a color sample. This will
+	 * be done once on release instead.
+	 */
+	/* moves are acknowledged by XCB_CONFIGURE_NOTIFY alone */
+	dragging.syncing = resize && syncrequest(c) == 0;
+	if (dragging.syncing)
+		dragging.requests += 2;
+
+	c->x = dragging.x;
+	c->y = dragging.y;
+	c->w = dragging.w;
+	c->h = dragging.h;
+	wm_teleport(curwid, c->x, c->y, c->w, c->h);
+
+	dragging.inflight = 1;
+	dragging.sent = t;
+	dragging.requests++;
+
+	return 1;
+}
+
+/*
+ * Return the time in milliseconds until drag_flush() may send the
+ * pending geometry, or -1 if there is none. The notification that the
+ * previous one was applied wakes the event loop up sooner.
+ */
+int
+drag_timeout()
+{
+	long t, frame, due;
+	struct client_t *c;
+
+	if (!dragging.pending || !(c = client(curwid)))
+		return -1;
+
+	t = now();
+	frame = interval(c->x + c->w/2, c->y + c->h/2, 16);
+
+	due = dragging.sent + frame;
+	if (dragging.inflight)
+		due = MAX(due, dragging.sent + (dragging.syncing ? 250 : 4 * frame));
+
+	return MAX(due - t, 0);
+}
+
+/*
+ * Callback used for all events that are not explicitely registered.
+ * This is not at all necessary, and used for debugging purposes.
+ */
+int
+cb_default(xcb_generic_event_t *ev)
+{
+	if (verbose < 2)
+		return 0;
+
+	if (XEV(ev)) {
+		fprintf(stderr, "%s not handled\n", XEV(ev));
+	} else {
+		fprintf(stderr, "EVENT %d not handled\n", ev->response_type);
+	}
+
+	return 0;
+}
+
+/*
+ * XCB_CREATE_NOTIFY is the first event triggered by new windows, and
+ * is used to prepare the window for use by the WM.
+ * The attribute `override_redirect` allow windows to specify that they
+ * shouldn't be handled by the WM.
+ */
+int
+cb_create(xcb_generic_event_t *ev)
+{
+	int x, y;
+	unsigned int seq;
+	struct client_t *c;
+	xcb_create_notify_event_t *e;
+
+	e = (xcb_create_notify_event_t *)ev;
+
+	if ((c = client_add(e->window))) {
+		c->x = e->x;
+		c->y = e->y;
+		c->w = e->width;
+		c->h = e->height;
+		c->b = e->border_width;
+		c->mapped = 0;
+		c->ignored = e->override_redirect;
+	}
+
+	if (e->override_redirect)
+		return 0;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->window);
+
+	x = getattr(e->window, ATTR_X);
+	y = getattr(e->window, ATTR_Y);
+
+	/* move window under the cursor, once its position is known */
+	if (!getattr(e->window, ATTR_M) && !x && !y) {
+		seq = xcb_query_pointer(conn, scrn->root).sequence;
+		defer(e->window, place, 1, &seq);
+	}
+
+	adopt(e->window);
+
+	return 0;
+}
+
+/*
+ * Continuation of cb_create(): center the window under the cursor,
+ * unless it got a position of its own in the meantime.
+ */
+void
+place(xcb_window_t wid, void **r)
+{
+	int x, y;
+	struct client_t *c;
+	struct monitor_t *m;
+	xcb_query_pointer_reply_t *p = r[0];
+
+	if (!p || !(c = client(wid)) || c->mapped || c->x || c->y)
+		return;
+
+	if ((m = monitor(p->root_x, p->root_y))) {
+		x = MAX(m->x, p->root_x - c->w/2);
+		y = MAX(m->y, p->root_y - c->h/2);
+
+		teleport(wid, x, y, c->w, c->h);
+	}
+}
+
+/*
+ * XCB_MAP_REQUEST is triggered by a window that wants to be mapped on
+ * screen. This is then the responsibility of the WM to map it on screen
+ * and eventually decorate it. This event require that the WM register
+ * XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT on the root window to intercept
+ * map requests.
+ */
+int
+cb_mapreq(xcb_generic_event_t *ev)
+{
+	struct client_t *c;
+	xcb_map_request_event_t *e;
+
+	e = (xcb_map_request_event_t *)ev;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->window);
+
+	/* the window must be placed where it belongs before showing up */
+	pending_settle(e->window);
+	if ((c = client(e->window)) && c->req.value_mask)
+		config_apply(c);
+
+	wm_remap(e->window, MAP);
+	setborder(e->window, border, 0);
+	wm_set_focus(e->window);
+	paint(e->window);
+
+	/* prevent window to pop outside the screen */
+	if (crossedge(e->window))
+		snaptoedge(e->window);
+
+	return 0;
+}
+
+/*
+ * The WM grabs XCB_BUTTON_PRESS events when the modifier is held.
+ * Once pressed, we'll grab the pointer entirely (without modifiers)
+ * and wait for motion/release events.
+ * The special mouse buttons 4/5 (scroll up/down) are treated especially,
+ * as they do not trigger any "release" event.
+ *
+ * This function must also save the window ID where the mouse press
+ * occured so we know which window to move/resize, even if the focus
+ * changes to another window.
+ * For similar reasons, we must save the cursor position.
+ */
+int
+cb_mouse_press(xcb_generic_event_t *ev)
+{
+	int mask;
+	static xcb_timestamp_t lasttime = 0;
+	xcb_button_press_event_t *e;
+	xcb_window_t wid;
+
+	e = (xcb_button_press_event_t *)ev;
+
+	/* ignore some button events if they happen too often */
+	if (e->time - lasttime < interval(e->root_x, e->root_y, 8))
+		return -1;
+
+	wid = e->child ? e->child : e->event;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x %d\n", XEV(e), wid, e->detail);
+
+	cursor.x = e->root_x - getattr(wid, ATTR_X);
+	cursor.y = e->root_y - getattr(wid, ATTR_Y);
+	cursor.b = e->detail;
+	lasttime = e->time;
+
+	memset(&dragging, 0, sizeof(dragging));
+	dragging.start = now();
+
+	mask = XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_BUTTON_MOTION;
+
+	switch(e->detail) {
+	case 1:
+		curwid = wid;
+		cursor.mode = GRAB_MOVE;
+		grab(mask, XHAIR_MOVE);
+		break;
+	case 2:
+		/* teleport acts on the last focused window */
+		cursor.x = e->root_x;
+		cursor.y = e->root_y;
+		cursor.mode = GRAB_TELE;
+		grab(mask, XHAIR_TELE);
+		if (opaque)
+			syncsetup(curwid);
+		break;
+	case 3:
+		curwid = wid;
+		cursor.mode = GRAB_SIZE;
+		grab(mask, XHAIR_SIZE);
+		if (opaque)
+			syncsetup(wid);
+		break;
+	case 4:
+		inflate(wid, move_step);
+		wm_restack(e->child, XCB_STACK_MODE_ABOVE);
+		break;
+	case 5:
+		inflate(wid, - move_step);
+		wm_restack(wid, XCB_STACK_MODE_ABOVE);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * When XCB_BUTTON_RELEASE is triggered, this will "commit" any
+ * move/resize initiated on a previous mouse press.
+ * This will also ungrab the mouse pointer.
+ */
+int
+cb_mouse_release(xcb_generic_event_t *ev)
+{
+	int x, y, w, h;
+	struct client_t *c;
+	xcb_button_release_event_t *e;
+
+	e = (xcb_button_release_event_t *)ev;
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x %d\n", XEV(e), e->event, e->detail);
+
+	/* only respond to release events for the current grab mode */
+	if (cursor.mode != GRAB_NONE && e->detail != cursor.b)
+		return -1;
+
+	xcb_change_window_attributes(conn, e->event, XCB_CW_CURSOR, &xcursor[XHAIR_DFLT]);
+	xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+
+	if (cursor.mode != GRAB_NONE) {
+		dragstats.drags++;
+		dragstats.requests += dragging.requests;
+		dragstats.ms += now() - dragging.start;
+	}
+
+	if (verbose && cursor.mode != GRAB_NONE)
+		fprintf(stderr, "Drag 0x%08x: %lu requests in %ld ms\n", curwid,
+			dragging.requests, now() - dragging.start);
+
+	/* commit the same geometry as the last one displayed */
+	if (!dragrect(e->detail, e->root_x, e->root_y, &x, &y, &w, &h)) {
+		if ((c = client(curwid)) && (c->w != w || c->h != h))
+			syncrequest(c);
+		teleport(curwid, x, y, w, h);
+	}
+
+	cursor.x = 0;
+	cursor.y = 0;
+	cursor.b = 0;
+	cursor.mode = GRAB_NONE;
+
+	wm_restack(curwid, XCB_STACK_MODE_ABOVE);
+
+	if (opaque) {
+		/* colors were not sampled while resizing */
+		if (dragging.resized && (c = client(curwid)))
+			sample_later(c);
+		memset(&dragging, 0, sizeof(dragging));
+		paint(curwid);
+		return 0;
+	}
+
+	/* the server exposes whatever the outline was covering */
+	outline(0, 0, 0, 0);
+	paint(curwid);
+
+	return 0;
+}
+
+/*
+ * When the pointer is grabbed, every move triggers a XCB_MOTION_NOTIFY.
+ * Events are reported for every single move by 1 pixel.
+ *
+ * This can spam a huge lot of events, and treating them all can be
+ * resource hungry and make the interface feels laggy.
+ * To get around this, the event loop collapses consecutive motion events
+ * into the latest one (see coalesce()). When `motion` is set to
+ * MOTION_THROTTLE in config.h, events are instead ignored based on their
+ * `time` attribute, and only processed once per frame of the monitor
+ * under the pointer.
+ *
+ * This callback is different from the others because it does not uses
+ * the ID of the window that reported the event, but an ID previously
+ * saved in cb_mouse_press().
+ * This makes sense as we want to move the last window we clicked on,
+ * and not the window we are moving over.
+ */
+int
+cb_motion(xcb_generic_event_t *ev)
+{
+	int x, y, w, h, button;
+	static xcb_timestamp_t lasttime = 0;
+	xcb_motion_notify_event_t *e;
+
+	e = (xcb_motion_notify_event_t *)ev;
+
+	/* ignore some motion events if they happen too often */
+	if (motion == MOTION_THROTTLE
+	 && e->time - lasttime < interval(e->root_x, e->root_y, 32))
+		return 0;
+
+	if (curwid == scrn->root)
+		return -1;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x %d,%d\n", XEV(e), curwid,
+			e->root_x, e->root_y);
+
+	lasttime = e->time;
+
+	switch (e->state & (XCB_BUTTON_MASK_1|XCB_BUTTON_MASK_2|XCB_BUTTON_MASK_3)) {
+	case XCB_BUTTON_MASK_1: button = 1; break;
+	case XCB_BUTTON_MASK_2: button = 2; break;
+	case XCB_BUTTON_MASK_3: button = 3; break;
+	default:
+		return -1;
+	}
+
+	dragrect(button, e->root_x, e->root_y, &x, &y, &w, &h);
+
+	if (opaque)
+		return drag(x, y, w, h);
+
+	return outline(x, y, w, h);
+}
+
+/*
+ * Each time the pointer moves from one window to another, an
+ * XCB_ENTER_NOTIFY event is fired. This is used to switch input focus
+ * between windows to follow where the pointer is.
+ */
+int
+cb_enter(xcb_generic_event_t *ev)
+{
+	xcb_enter_notify_event_t *e;
+
+	e = (xcb_enter_notify_event_t *)ev;
+
+	if (getattr(e->event, ATTR_I))
+		return 0;
+
+	if (cursor.mode != GRAB_NONE)
+		return 0;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->event);
+
+	/*
+	 * Sweeping the pointer across windows fires one event per window
+	 * crossed, and only the last one matters. Focus is changed once
+	 * all queued events are processed, see focus_flush().
+	 */
+	focusreq = e->event;
+
+	return 0;
+}
+
+/*
+ * Give focus to the window the pointer last entered, if it didn't get
+ * destroyed or unmapped in the meantime.
+ * Return 1 if the focus was changed, 0 otherwise.
+ */
+int
+focus_flush()
+{
+	struct client_t *c;
+	xcb_window_t wid;
+
+	wid = focusreq;
+	focusreq = 0;
+
+	if (!wid || wid == focuswid)
+		return 0;
+
+	if (!(c = client(wid)) || !c->mapped)
+		return 0;
+
+	wm_set_focus(wid);
+
+	return 1;
+}
+
+/*
+ * Whenever the input focus change from one window to another, both an
+ * XCB_FOCUS_OUT and XCB_FOCUS_IN are fired.
+ * This is the occasion to change the border color to represent focus.
+ */
+int
+cb_focus(xcb_generic_event_t *ev)
+{
+	int grab;
+	xcb_focus_in_event_t *e;
+
+	e = (xcb_focus_in_event_t *)ev;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->event);
+
+	/*
+	 * Keep track of the focused window to avoid asking the server
+	 * about it for every paint(). Focus events caused by a keyboard
+	 * grab don't actually move the focus.
+	 */
+	grab = e->mode == XCB_NOTIFY_MODE_GRAB || e->mode == XCB_NOTIFY_MODE_UNGRAB;
+
+	switch(e->response_type & ~0x80) {
+	case XCB_FOCUS_IN:
+		curwid = e->event;
+		if (!grab)
+			focuswid = e->event;
+		return paint(e->event);
+		break; /* NOTREACHED */
+	case XCB_FOCUS_OUT:
+		if (!grab && focuswid == e->event)
+			focuswid = XCB_NONE;
+		return paint(e->event);
+		break; /* NOTREACHED */
+	}
+
+	return -1;
+}
+
+/*
+ * XCB_CONFIGURE_REQUEST is triggered by every window that wants to
+ * change its attributes like size, stacking order or border.
+ * These must now be handled by the WM because of the
+ * XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT registration.
+ */
+int
+cb_configreq(xcb_generic_event_t *ev)
+{
+	uint16_t mask;
+	struct client_t *c;
+	xcb_configure_request_event_t *e;
+
+	e = (xcb_configure_request_event_t *)ev;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x 0x%08x:%dx%d+%d+%d\n",
+			XEV(e), e->parent, e->window,
+			e->width, e->height,
+			e->x, e->y);
+
+	/* the window couldn't be queried, let it configure itself */
+	if (!(c = client(e->window)) && !(c = client_fetch(e->window)))
+		return config_forward(e);
+
+	cfgstats.requests++;
+
+	/*
+	 * Some clients send a storm of requests, eg. when zooming. They
+	 * are merged together, so that each window is only moved and
+	 * repainted once per batch of events, see config_flush().
+	 */
+	if (c->req.value_mask) {
+		cfgstats.merged++;
+	} else {
+		c->cnext = configs;
+		configs = c;
+	}
+
+	mask = e->value_mask;
+	c->req.window = e->window;
+	c->req.value_mask |= mask;
+	if (mask & XCB_CONFIG_WINDOW_X)            c->req.x = e->x;
+	if (mask & XCB_CONFIG_WINDOW_Y)            c->req.y = e->y;
+	if (mask & XCB_CONFIG_WINDOW_WIDTH)        c->req.width = e->width;
+	if (mask & XCB_CONFIG_WINDOW_HEIGHT)       c->req.height = e->height;
+	if (mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) c->req.border_width = e->border_width;
+	if (mask & XCB_CONFIG_WINDOW_STACK_MODE)   c->req.stack_mode = e->stack_mode;
+
+	return 0;
+}
+
+/*
+ * Honor the configure requests of a window, merged by cb_configreq().
+ */
+int
+config_apply(struct client_t *c)
+{
+	int x, y, w, h;
+	xcb_configure_request_event_t e;
+
+	e = c->req;
+	config_cancel(c);
+
+	if (e.value_mask &
+		( XCB_CONFIG_WINDOW_X
+		| XCB_CONFIG_WINDOW_Y
+		| XCB_CONFIG_WINDOW_WIDTH
+		| XCB_CONFIG_WINDOW_HEIGHT)) {
+		x = getattr(e.window, ATTR_X);
+		y = getattr(e.window, ATTR_Y);
+		w = getattr(e.window, ATTR_W);
+		h = getattr(e.window, ATTR_H);
+
+		if (e.value_mask & XCB_CONFIG_WINDOW_X) x = e.x;
+		if (e.value_mask & XCB_CONFIG_WINDOW_Y) y = e.y;
+		if (e.value_mask & XCB_CONFIG_WINDOW_WIDTH)  w = e.width;
+		if (e.value_mask & XCB_CONFIG_WINDOW_HEIGHT) h = e.height;
+
+		teleport(e.window, x, y, w, h);
+
+		/* redraw border pixmap after move/resize */
+		paint(e.window);
+	}
+
+	if (e.value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+		setborder(e.window, e.border_width, border_color);
+
+	if (e.value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
+		wm_restack(e.window, e.stack_mode);
+
+	return 0;
+}
+
+/*
+ * Send a configure request to the server as is, for windows missing
+ * from the window table.
+ */
+int
+config_forward(xcb_configure_request_event_t *e)
+{
+	int n = 0;
+	uint32_t val[7];
+
+	if (e->value_mask & XCB_CONFIG_WINDOW_X)            val[n++] = e->x;
+	if (e->value_mask & XCB_CONFIG_WINDOW_Y)            val[n++] = e->y;
+	if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH)        val[n++] = e->width;
+	if (e->value_mask & XCB_CONFIG_WINDOW_HEIGHT)       val[n++] = e->height;
+	if (e->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) val[n++] = e->border_width;
+	if (e->value_mask & XCB_CONFIG_WINDOW_SIBLING)      val[n++] = e->sibling;
+	if (e->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)   val[n++] = e->stack_mode;
+
+	xcb_configure_window(conn, e->window, e->value_mask, val);
+
+	return 0;
+}
+
+/*
+ * Remove the window from the list of pending configure requests.
+ */
+void
+config_cancel(struct client_t *c)
+{
+	struct client_t **p;
+
+	for (p = &configs; *p; p = &(*p)->cnext) {
+		if (*p == c) {
+			*p = c->cnext;
+			break;
+		}
+	}
+
+	c->req.value_mask = 0;
+	c->cnext = NULL;
+}
+
+/*
+ * Apply all pending configure requests, once the events queue is
+ * drained. Return the number of windows configured.
+ */
+int
+config_flush()
+{
+	int n = 0;
+
+	while (configs) {
+		config_apply(configs);
+		n++;
+	}
+
+	return n;
+}
+
+int
+cb_configure(xcb_generic_event_t *ev)
+{
+	int resized;
+	struct client_t *c;
+	xcb_configure_notify_event_t *e;
+
+	e = (xcb_configure_notify_event_t *)ev;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x %dx%d+%d+%d\n",
+			XEV(e), e->window,
+			e->width, e->height,
+			e->x, e->y);
+
+	/* update screen size when root window's size change */
+	if (e->window == scrn->root) {
+		scrn->width_in_pixels = e->width;
+		scrn->height_in_pixels = e->height;
+	}
+
+	/* the last geometry sent by drag() has been applied */
+	if (e->window == curwid && dragging.inflight && !dragging.syncing) {
+		dragging.inflight = 0;
+		drag_flush();
+	}
+
+	if ((c = client(e->window))) {
+		resized = (c->w != e->width || c->h != e->height);
+		c->x = e->x;
+		c->y = e->y;
+		c->w = e->width;
+		c->h = e->height;
+		c->b = e->border_width;
+		edges_update(c);
+		if (resized && !c->ignored)
+			sample_later(c);
+		if (c->above != e->above_sibling) {
+			c->above = e->above_sibling;
+			ewmh_restack(c);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The following callbacks only exist to keep the window table in sync
+ * with the server.
+ * Note that windows reparented away from the root window are dropped
+ * from the table, because their coordinates would then be relative to
+ * their new parent.
+ */
+int
+cb_destroy(xcb_generic_event_t *ev)
+{
+	struct client_t *c;
+	xcb_destroy_notify_event_t *e;
+
+	e = (xcb_destroy_notify_event_t *)ev;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->window);
+
+	/* the server freed the damage object along with the window */
+	if ((c = client(e->window)))
+		c->damage = XCB_NONE;
+
+	client_del(e->window);
+
+	return 0;
+}
+
+int
+cb_map(xcb_generic_event_t *ev)
+{
+	struct client_t *c;
+	xcb_map_notify_event_t *e;
+
+	e = (xcb_map_notify_event_t *)ev;
+
+	if ((c = client(e->window)) && !c->mapped) {
+		c->mapped = 1;
+		edges_update(c);
+		if (!c->ignored) {
+			sample_later(c);
+			ewmh_add(e->window, 1);
+		}
+	}
+
+	return 0;
+}
+
+int
+cb_unmap(xcb_generic_event_t *ev)
+{
+	struct client_t *c;
+	xcb_unmap_notify_event_t *e;
+
+	e = (xcb_unmap_notify_event_t *)ev;
+
+	if ((c = client(e->window))) {
+		c->mapped = 0;
+		edges_del(c);
+		ewmh_del(e->window);
+		c->sampling = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * DAMAGE_NOTIFY is only received when following windows content. Damage
+ * is reported as a bounding box that grows until the next sample clears
+ * it: a window drawn over and over in the middle sends a single event,
+ * and one redrawn entirely on every frame sends one per sample at most.
+ * Windows are only sampled again when the box covers one of their
+ * corners, and no sooner than damage_interval after the last sample.
+ */
+int
+cb_damage(xcb_generic_event_t *ev)
+{
+	int cx, cy;
+	struct client_t *c;
+	xcb_rectangle_t *a;
+	xcb_damage_notify_event_t *e;
+
+	e = (xcb_damage_notify_event_t *)ev;
+	a = &e->area;
+
+	if (verbose > 1)
+		fprintf(stderr, "%s 0x%08x %dx%d+%d+%d\n", XEV(e), e->drawable,
+			a->width, a->height, a->x, a->y);
+
+	if (!(c = client(e->drawable)) || c->dirty)
+		return 0;
+
+	cx = (a->x <= 0 && a->x + a->width > 0)
+	  || (a->x <= c->w - 1 && a->x + a->width > c->w - 1);
+	cy = (a->y <= 0 && a->y + a->height > 0)
+	  || (a->y <= c->h - 1 && a->y + a->height > c->h - 1);
+
+	if (cx && cy) {
+		c->dirty = 1;
+		c->dnext = damaged;
+		damaged = c;
+	}
+
+	return 0;
+}
+
+/*
+ * RandR events are fired whenever the monitors layout or their modes
+ * change, which is when the monitors table must be read again.
+ * A single change fires one event per CRTC and output involved, so the
+ * table is only marked as stale here, and rebuilt once by the next
+ * lookup, see monitor().
+ */
+int
+cb_randr(xcb_generic_event_t *ev)
+{
+	xcb_randr_screen_change_notify_event_t *e;
+
+	if (verbose)
+		fprintf(stderr, "%s\n", XEV(ev));
+
+	if ((ev->response_type & ~0x80) == randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+		e = (xcb_randr_screen_change_notify_event_t *)ev;
+		if (e->root == scrn->root) {
+			scrn->width_in_pixels = e->width;
+			scrn->height_in_pixels = e->height;
+		}
+	}
+
+	relayout = 1;
+
+	return 0;
+}
+
+/*
+ * XCB_SYNC_ALARM_NOTIFY is fired when a client updated its sync counter,
+ * meaning it is done redrawing after the last resize.
+ */
+int
+cb_alarm(xcb_generic_event_t *ev)
+{
+	struct client_t *c;
+	xcb_sync_alarm_notify_event_t *e;
+
+	e = (xcb_sync_alarm_notify_event_t *)ev;
+
+	if (verbose > 1)
+		fprintf(stderr, "%s 0x%08x %u\n", XEV(e), e->alarm,
+			e->counter_value.lo);
+
+	if ((c = client(curwid)) && c->alarm == e->alarm && dragging.syncing) {
+		dragging.syncing = 0;
+		dragging.inflight = 0;
+		drag_flush();
+	}
+
+	return 0;
+}
+
+/*
+ * XCB_PROPERTY_NOTIFY is fired when a window property changes. The size
+ * hints are read again when the client updates them, eg. when the font
+ * size of a terminal changes.
+ */
+int
+cb_property(xcb_generic_event_t *ev)
+{
+	xcb_property_notify_event_t *e;
+
+	e = (xcb_property_notify_event_t *)ev;
+
+	if (e->atom != XCB_ATOM_WM_NORMAL_HINTS || !client(e->window))
+		return 0;
 
 	if (verbose)
 		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->window);
 
-	wm_remap(e->window, MAP);
-	wm_set_border(border, 0, e->window);
+	hints_fetch(e->window);
+
+	return 0;
+}
+
+/*
+ * Pagers and task bars ask for a window to be activated by sending
+ * _NET_ACTIVE_WINDOW to the root window. It is raised and focused, as
+ * when clicked.
+ */
+int
+cb_message(xcb_generic_event_t *ev)
+{
+	struct client_t *c;
+	xcb_client_message_event_t *e;
+
+	e = (xcb_client_message_event_t *)ev;
+
+	if (e->type != atoms[NET_ACTIVE_WINDOW])
+		return 0;
+
+	if (verbose)
+		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->window);
+
+	if (cursor.mode != GRAB_NONE || !(c = client(e->window))
+	 || c->ignored || !c->mapped)
+		return 0;
+
+	wm_restack(e->window, XCB_STACK_MODE_ABOVE);
 	wm_set_focus(e->window);
-	paint(e->window);
 
-	/* prevent window to pop outside the screen */
-	if (crossedge(e->window))
-		snaptoedge(e->window);
+	/* don't let a pending XCB_ENTER_NOTIFY take it back */
+	focusreq = XCB_NONE;
+
+	return 0;
+}
+
+int
+cb_reparent(xcb_generic_event_t *ev)
+{
+	xcb_reparent_notify_event_t *e;
+
+	e = (xcb_reparent_notify_event_t *)ev;
+
+	if (e->parent != scrn->root)
+		client_del(e->window);
 
 	return 0;
 }
 
 /*
- * The WM grabs XCB_BUTTON_PRESS events when the modifier is held.
- * Once pressed, we'll grab the pointer entirely (without modifiers)
- * and wait for motion/release events.
- * The special mouse buttons 4/5 (scroll up/down) are treated especially,
- * as they do not trigger any "release" event.
- *
- * This function must also save the window ID where the mouse press
- * occured so we know which window to move/resize, even if the focus
- * changes to another window.
- * For similar reasons, we must save the cursor position.
+ * Pointer motion is reported for every pixel the pointer moves, which is
+ * more than can be drawn on screen. Consecutive XCB_MOTION_NOTIFY events
+ * that are already queued are collapsed into the latest one, so every
+ * batch is handled exactly once, and the last position is never lost.
+ * The first event that isn't a motion is saved for the next iteration of
+ * the event loop.
  */
-int
-cb_mouse_press(xcb_generic_event_t *ev)
+xcb_generic_event_t *
+coalesce(xcb_generic_event_t *ev)
 {
-	int mask;
-	static xcb_timestamp_t lasttime = 0;
-	xcb_button_press_event_t *e;
-	xcb_window_t wid;
+	xcb_generic_event_t *next;
 
-	e = (xcb_button_press_event_t *)ev;
+	if ((ev->response_type & ~0x80) != XCB_MOTION_NOTIFY)
+		return ev;
 
-	/* ignore some motion events if they happen too often */
-	if (e->time - lasttime < 8)
+	while ((next = xcb_poll_for_queued_event(conn))) {
+		if ((next->response_type & ~0x80) != XCB_MOTION_NOTIFY) {
+			lookahead = next;
+			break;
+		}
+
+		free(ev);
+		ev = next;
+	}
+
+	return ev;
+}
+
+/*
+ * Build the table used to dispatch events to their callback, indexed by
+ * event type. Extension events numbers are only known at runtime, so
+ * this must be called once the extensions are initialized.
+ */
+void
+ev_init()
+{
+	size_t i;
+
+	for (i = 0; i < LEN(handler); i++)
+		handler[i] = cb_default;
+
+	for (i = 0; i < LEN(cb); i++)
+		handler[cb[i].type] = cb[i].handle;
+
+	if (randr) {
+		i = randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY;
+		evname[i] = "RANDR_SCREEN_CHANGE_NOTIFY";
+		handler[i] = cb_randr;
+
+		i = randr->first_event + XCB_RANDR_NOTIFY;
+		evname[i] = "RANDR_NOTIFY";
+		handler[i] = cb_randr;
+	}
+
+	if (xsync) {
+		i = xsync->first_event + XCB_SYNC_ALARM_NOTIFY;
+		evname[i] = "SYNC_ALARM_NOTIFY";
+		handler[i] = cb_alarm;
+	}
+
+	if (xdamage) {
+		i = xdamage->first_event + XCB_DAMAGE_NOTIFY;
+		evname[i] = "DAMAGE_NOTIFY";
+		handler[i] = cb_damage;
+	}
+}
+
+/*
+ * Call out the callback function registered for each EVENT fired.
+ * The time spent in each callback is recorded in a log2 histogram
+ * (in microseconds) for each event type, which can be dumped with
+ * SIGUSR1.
+ */
+int
+ev_callback(xcb_generic_event_t *ev)
+{
+	int r;
+	size_t k;
+	uint32_t type;
+	unsigned long us;
+	struct timespec t0, t1;
+#ifdef STATS
+	uint64_t seq;
+#endif
+
+	if (!ev)
 		return -1;
 
-	wid = e->child ? e->child : e->event;
+	type = ev->response_type & ~0x80;
 
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x %d\n", XEV(e), wid, e->detail);
+#ifdef STATS
+	curev = type;
+	seq = st_conn.seq;
+#endif
 
-	cursor.x = e->root_x - wm_get_attribute(wid, ATTR_X);
-	cursor.y = e->root_y - wm_get_attribute(wid, ATTR_Y);
-	cursor.b = e->detail;
-	lasttime = e->time;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	r = handler[type](ev);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
 
-	mask = XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_BUTTON_MOTION;
+#ifdef STATS
+	evstat[type].calls++;
+	evstat[type].requests += st_conn.seq - seq;
+	curev = LEN(evstat) - 1;
+#endif
 
-	switch(e->detail) {
-	case 1:
-		curwid = wid;
-		cursor.mode = GRAB_MOVE;
-		wm_reg_cursor_event(scrn->root, mask, xhair[XHAIR_MOVE]);
-		break;
-	case 2:
-		/* teleport acts on the last focused window */
-		cursor.x = e->root_x;
-		cursor.y = e->root_y;
-		cursor.mode = GRAB_TELE;
-		wm_reg_cursor_event(scrn->root, mask, xhair[XHAIR_TELE]);
-		break;
-	case 3:
-		curwid = wid;
-		cursor.mode = GRAB_SIZE;
-		wm_reg_cursor_event(scrn->root, mask, xhair[XHAIR_SIZE]);
-		break;
-	case 4:
-		inflate(wid, move_step);
-		wm_restack(e->child, XCB_STACK_MODE_ABOVE);
-		break;
-	case 5:
-		inflate(wid, - move_step);
-		wm_restack(wid, XCB_STACK_MODE_ABOVE);
-		break;
-	default:
+	us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+	for (k = 0; us > 1 && k < LEN(latency[type]) - 1; us >>= 1)
+		k++;
+	latency[type][k]++;
+
+	return r;
+}
+
+/*
+ * Print statistics about the WM internals, one record per line, so they
+ * can easily be parsed. Latencies are the upper bound of their histogram
+ * bucket, in microseconds. When compiled with STATS, the number of
+ * requests and blocking replies of each callback and helper, and the
+ * time spent waiting (in microseconds) are printed as well.
+ */
+void
+stats(FILE *f)
+{
+	size_t i, k;
+	unsigned long n, sum, p50, p99;
+
+	fprintf(f, "pixmap hits %lu misses %lu evictions %lu\n",
+		pxstats.hits, pxstats.misses, pxstats.evictions);
+	fprintf(f, "configure requests %lu merged %lu\n",
+		cfgstats.requests, cfgstats.merged);
+	fprintf(f, "drag %s count %lu requests %lu ms %lu\n",
+		opaque ? "opaque" : "outline", dragstats.drags,
+		dragstats.requests, dragstats.ms);
+
+	for (i = 0; i < LEN(latency); i++) {
+		for (n = 0, k = 0; k < LEN(latency[i]); k++)
+			n += latency[i][k];
+
+		if (!n)
+			continue;
+
+		p50 = p99 = 0;
+		for (sum = 0, k = 0; k < LEN(latency[i]); k++) {
+			sum += latency[i][k];
+			if (!p50 && sum * 2 >= n)
+				p50 = 2UL << k;
+			if (!p99 && sum * 100 >= n * 99)
+				p99 = 2UL << k;
+		}
+
+		if (evname[i])
+			fprintf(f, "event %s count %lu p50 %lu p99 %lu hist", evname[i], n, p50, p99);
+		else
+			fprintf(f, "event %zu count %lu p50 %lu p99 %lu hist", i, n, p50, p99);
+
+		for (k = 0; k < LEN(latency[i]); k++)
+			fprintf(f, " %lu", latency[i][k]);
+		fprintf(f, "\n");
+	}
+
+#ifdef STATS
+	/* requests sent and replies waited on, per callback then helper */
+	for (i = 0; i < LEN(evstat); i++) {
+		n = evstat[i].calls ? evstat[i].calls : 1;
+		if (!evstat[i].calls && !evstat[i].replies)
+			continue;
+
+		if (i == LEN(evstat) - 1)
+			fprintf(f, "requests OTHER");
+		else if (evname[i])
+			fprintf(f, "requests %s", evname[i]);
+		else
+			fprintf(f, "requests %zu", i);
+
+		fprintf(f, " calls %lu requests %lu replies %lu blocked %lu"
+			" avg_requests %.2f avg_replies %.2f avg_blocked %.1f\n",
+			evstat[i].calls, evstat[i].requests, evstat[i].replies,
+			evstat[i].blocked, (double)evstat[i].requests / n,
+			(double)evstat[i].replies / n, (double)evstat[i].blocked / n);
+	}
+
+	for (i = 0; i < LEN(helperstat); i++) {
+		if (!helperstat[i].calls)
+			continue;
+
+		fprintf(f, "helper %s calls %lu requests %lu replies %lu blocked %lu\n",
+			helpername[i], helperstat[i].calls, helperstat[i].requests,
+			helperstat[i].replies, helperstat[i].blocked);
+	}
+#endif /* STATS */
+
+	fflush(f);
+}
+
+/*
+ * Signal handlers only raise a flag, which the event loop checks before
+ * waiting. A byte is also written to a pipe it polls, so that a signal
+ * caught right before poll() doesn't wait for the next X event.
+ */
+void
+sigwake()
+{
+	int e;
+	ssize_t r;
+
+	e = errno;
+	r = write(sigfd[1], "", 1);
+	(void)r;
+	errno = e;
+}
+
+void
+sigusr1(int sig)
+{
+	(void)sig;
+	dumpstats = 1;
+	sigwake();
+}
+
+/*
+ * SIGHUP restarts the WM once the events being processed are done with,
+ * see restart().
+ */
+void
+sighup(int sig)
+{
+	(void)sig;
+	restarting = 1;
+	sigwake();
+}
+
+/*
+ * Listen for commands on a UNIX socket, so that windows can be driven
+ * by scripts without opening a new X connection for each operation.
+ * Commands reuse the WM connection and window table, and all commands
+ * read at once are sent to the server with a single flush.
+ */
+int
+ctl_init(char *path)
+{
+	size_t i;
+	mode_t mask;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
 		return -1;
 	}
 
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((ctlfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* only the user running the WM may drive it */
+	unlink(path);
+	mask = umask(077);
+	if (bind(ctlfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	 || listen(ctlfd, LEN(ctls)) < 0) {
+		umask(mask);
+		perror(path);
+		close(ctlfd);
+		ctlfd = -1;
+		return -1;
+	}
+	umask(mask);
+
+	fcntl(ctlfd, F_SETFL, fcntl(ctlfd, F_GETFL) | O_NONBLOCK);
+	fcntl(ctlfd, F_SETFD, FD_CLOEXEC);
+
+	for (i = 0; i < LEN(ctls); i++)
+		ctls[i].fd = -1;
+
+	/* clients going away must not kill the WM */
+	signal(SIGPIPE, SIG_IGN);
+
 	return 0;
 }
 
 /*
- * When XCB_BUTTON_RELEASE is triggered, this will "commit" any
- * move/resize initiated on a previous mouse press.
- * This will also ungrab the mouse pointer.
+ * Fill the poll array with the listening socket, followed by the
+ * connected clients. Return the number of entries used.
  */
 int
-cb_mouse_release(xcb_generic_event_t *ev)
+ctl_pollfd(struct pollfd *pfd, int max)
 {
-	int x, y, w, h;
-	xcb_cursor_t p;
-	xcb_cursor_context_t *cx;
-	xcb_button_release_event_t *e;
+	int n = 0;
+	size_t i;
 
-	e = (xcb_button_release_event_t *)ev;
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x %d\n", XEV(e), e->event, e->detail);
+	if (ctlfd < 0)
+		return 0;
 
-	/* only respond to release events for the current grab mode */
-	if (cursor.mode != GRAB_NONE && e->detail != cursor.b)
-		return -1;
+	pfd[n].fd = ctlfd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
 
-	if (xcb_cursor_context_new(conn, scrn, &cx) < 0) {
-		fprintf(stderr, "cannot instantiate cursor\n");
-		exit(1);
+	for (i = 0; i < LEN(ctls) && n < max; i++) {
+		if (ctls[i].fd >= 0) {
+			pfd[n].fd = ctls[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n++].revents = 0;
+		}
 	}
 
-	p = xcb_cursor_load_cursor(cx, xhair[XHAIR_DFLT]);
-	xcb_change_window_attributes(conn, e->event, XCB_CW_CURSOR, &p);
-	xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+	return n;
+}
 
-	xcb_cursor_context_free(cx);
+/*
+ * Accept new clients, and run the commands received from the others,
+ * one per line.
+ */
+void
+ctl_handle(struct pollfd *pfd, int n)
+{
+	int i, fd;
+	size_t j;
+	ssize_t r;
+	char *line, *nl;
+	struct ctl_t *c;
 
-	switch (e->detail) {
-	case 1:
-		w = wm_get_attribute(curwid, ATTR_W);
-		h = wm_get_attribute(curwid, ATTR_H);
-		wm_teleport(curwid, e->root_x - cursor.x, e->root_y - cursor.y, w, h);
-		break;
-	case 2:
-		x = MIN(e->root_x,cursor.x);
-		y = MIN(e->root_y,cursor.y);
-		w = MAX(e->root_x,cursor.x) - x;
-		h = MAX(e->root_y,cursor.y) - y;
-		wm_teleport(curwid, x, y, w, h);
-		break;
-	case 3:
-		x = wm_get_attribute(curwid, ATTR_X);
-		y = wm_get_attribute(curwid, ATTR_Y);
-		wm_teleport(curwid, x, y, e->root_x - x, e->root_y - y);
-		break;
+	for (i = 0; i < n; i++) {
+		if (!pfd[i].revents)
+			continue;
+
+		if (pfd[i].fd == ctlfd) {
+			if ((fd = accept(ctlfd, NULL, NULL)) < 0)
+				continue;
+			for (j = 0; j < LEN(ctls) && ctls[j].fd >= 0; j++);
+			if (j == LEN(ctls)) {
+				close(fd);
+				continue;
+			}
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			ctls[j].fd = fd;
+			ctls[j].len = 0;
+			ctls[j].olen = 0;
+			continue;
+		}
+
+		for (c = NULL, j = 0; j < LEN(ctls); j++)
+			if (ctls[j].fd == pfd[i].fd)
+				c = &ctls[j];
+		if (!c)
+			continue;
+
+		r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+
+		if (r <= 0) {
+			/* run the last command, even if not newline terminated */
+			if (c->len) {
+				c->buf[c->len] = 0;
+				ctl_exec(c, c->buf);
+			}
+			ctl_close(c);
+			continue;
+		}
+
+		c->len += r;
+		c->buf[c->len] = 0;
+
+		/* stop short if the client got dropped, see ctl_flush() */
+		for (line = c->buf; c->fd >= 0 && (nl = strchr(line, '\n')); line = nl + 1) {
+			*nl = 0;
+			ctl_exec(c, line);
+		}
+
+		if (c->fd < 0)
+			continue;
+
+		c->len -= line - c->buf;
+		memmove(c->buf, line, c->len);
+
+		if (c->len == sizeof(c->buf) - 1) {
+			ctl_reply(c, "error line too long\n");
+			c->len = 0;
+		}
+
+		ctl_flush(c);
 	}
+}
 
-	cursor.x = 0;
-	cursor.y = 0;
-	cursor.b = 0;
-	cursor.mode = GRAB_NONE;
+/*
+ * Replies are buffered, and sent once all the commands read at once
+ * are processed.
+ * Client sockets don't block: the event loop can't wait on a client that
+ * doesn't read its replies, so such clients are dropped instead.
+ */
+void
+ctl_reply(struct ctl_t *c, const char *fmt, ...)
+{
+	int n;
+	va_list ap;
 
-	wm_restack(curwid, XCB_STACK_MODE_ABOVE);
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(c->out + c->olen, sizeof(c->out) - c->olen, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+		if ((size_t)n < sizeof(c->out) - c->olen || !c->olen)
+			break;
+
+		ctl_flush(c);
+	}
+
+	c->olen = MIN(c->olen + n, sizeof(c->out) - 1);
+}
 
-	/* clear last drawn rectangle to avoid leaving artefacts */
-	outline(scrn->root, 0, 0, 0, 0);
-	xcb_clear_area(conn, 0, scrn->root, 0, 0, 0, 0);
+void
+ctl_flush(struct ctl_t *c)
+{
+	ssize_t r;
+	size_t off = 0;
+
+	while (c->fd >= 0 && off < c->olen) {
+		if ((r = write(c->fd, c->out + off, c->olen - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			close(c->fd);
+			c->fd = -1;
+			c->len = 0;
+			break;
+		}
+		off += r;
+	}
 
-	w = wm_get_attribute(curwid, ATTR_W);
-	h = wm_get_attribute(curwid, ATTR_H);
-	xcb_clear_area(conn, 1, curwid, 0, 0, w, h);
-	paint(curwid);
+	c->olen = 0;
+}
 
-	return 0;
+void
+ctl_close(struct ctl_t *c)
+{
+	ctl_flush(c);
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->len = 0;
 }
 
 /*
- * When the pointer is grabbed, every move triggers a XCB_MOTION_NOTIFY.
- * Events are reported for every single move by 1 pixel.
+ * Run a single command. Window IDs can be given in any base understood
+ * by strtoul(3), and geometries are absolute for teleport, relative for
+ * all other commands.
  *
- * This can spam a huge lot of events, and treating them all can be
- * resource hungry and make the interface feels laggy.
- * To get around this, we must ignore some of these events. This is done
- * by using the `time` attribute, and only processing new events every
- * X milliseconds.
+ *	teleport <wid> <x> <y> <w> <h>
+ *	move <wid> <dx> <dy>
+ *	resize <wid> <dw> <dh>
+ *	inflate <wid> <step>
+ *	focus <wid>
+ *	restack <wid> raise|lower|toggle
+ *	list
+ *	restart
  *
- * This callback is different from the others because it does not uses
- * the ID of the window that reported the event, but an ID previously
- * saved in cb_mouse_press().
- * This makes sense as we want to move the last window we clicked on,
- * and not the window we are moving over.
+ * Every command is answered with "ok", or "error" followed by a reason.
+ * The list command first prints one line per mapped window, with its ID
+ * and geometry.
  */
-int
-cb_motion(xcb_generic_event_t *ev)
+void
+ctl_exec(struct ctl_t *c, char *line)
 {
-	int x, y, w, h;
-	static xcb_timestamp_t lasttime = 0;
-	xcb_motion_notify_event_t *e;
-
-	e = (xcb_motion_notify_event_t *)ev;
+	int n, arg[4];
+	size_t i;
+	char cmd[16], id[16], mode[16];
+	xcb_window_t wid = 0;
+	struct client_t *w = NULL;
+
+	if (sscanf(line, "%15s", cmd) != 1)
+		return;
+
+	if (!strcmp(cmd, "restart")) {
+		restarting = 1;
+		ctl_reply(c, "ok\n");
+		return;
+	}
 
-	/* ignore some motion events if they happen too often */
-	if (e->time - lasttime < 32)
-		return 0;
+	if (!strcmp(cmd, "list")) {
+		for (i = 0; i < LEN(clients); i++)
+			for (w = clients[i]; w; w = w->next)
+				if (w->mapped && !w->ignored)
+					ctl_reply(c, "0x%08x %d %d %d %d\n",
+						w->wid, w->x, w->y, w->w, w->h);
+		ctl_reply(c, "ok\n");
+		return;
+	}
 
-	if (curwid == scrn->root)
-		return -1;
+	n = sscanf(line, "%*s %15s %d %d %d %d", id,
+		&arg[0], &arg[1], &arg[2], &arg[3]);
+	if (n > 0)
+		wid = strtoul(id, NULL, 0);
 
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x %d,%d\n", XEV(e), curwid,
-			e->root_x, e->root_y);
+	if (n < 1 || !wid) {
+		ctl_reply(c, "error missing window\n");
+		return;
+	}
 
-	lasttime = e->time;
+	if (!(w = client(wid)) && !(w = client_fetch(wid))) {
+		ctl_reply(c, "error no such window 0x%08x\n", wid);
+		return;
+	}
 
-	switch (e->state & (XCB_BUTTON_MASK_1|XCB_BUTTON_MASK_2|XCB_BUTTON_MASK_3)) {
-	case XCB_BUTTON_MASK_1:
-		x = e->root_x - cursor.x;
-		y = e->root_y - cursor.y;
-		w = wm_get_attribute(curwid, ATTR_W);
-		h = wm_get_attribute(curwid, ATTR_H);
-		outline(scrn->root, x, y, w, h);
-		break;
-	case XCB_BUTTON_MASK_2:
-		x = MIN(cursor.x, e->root_x);
-		y = MIN(cursor.y, e->root_y);
-		w = MAX(cursor.x - e->root_x, e->root_x - cursor.x);
-		h = MAX(cursor.y - e->root_y, e->root_y - cursor.y);
-		outline(scrn->root, x, y, w, h);
-		break;
-	case XCB_BUTTON_MASK_3:
-		x = wm_get_attribute(curwid, ATTR_X);
-		y = wm_get_attribute(curwid, ATTR_Y);
-		w = e->root_x - x;
-		h = e->root_y - y;
-		outline(scrn->root, x, y, w, h);
-		break;
-	default:
-		return -1;
+	if (!strcmp(cmd, "teleport") && n == 5) {
+		if (arg[2] < 1 || arg[3] < 1) {
+			ctl_reply(c, "error invalid size %dx%d\n", arg[2], arg[3]);
+			return;
+		}
+		sizehint(wid, &arg[2], &arg[3]);
+		teleport(wid, arg[0], arg[1], arg[2], arg[3]);
+		paint(wid);
+	} else if (!strcmp(cmd, "move") && n == 3) {
+		teleport(wid, w->x + arg[0], w->y + arg[1], w->w, w->h);
+	} else if (!strcmp(cmd, "resize") && n == 3) {
+		arg[0] += w->w;
+		arg[1] += w->h;
+		if (arg[0] < 1 || arg[1] < 1) {
+			ctl_reply(c, "error invalid size %dx%d\n", arg[0], arg[1]);
+			return;
+		}
+		sizehint(wid, &arg[0], &arg[1]);
+		teleport(wid, w->x, w->y, arg[0], arg[1]);
+		paint(wid);
+	} else if (!strcmp(cmd, "inflate") && n == 2) {
+		inflate(wid, arg[0]);
+	} else if (!strcmp(cmd, "focus") && n == 1) {
+		wm_set_focus(wid);
+	} else if (!strcmp(cmd, "restack")
+	        && sscanf(line, "%*s %*s %15s", mode) == 1) {
+		if (!strcmp(mode, "raise"))
+			wm_restack(wid, XCB_STACK_MODE_ABOVE);
+		else if (!strcmp(mode, "lower"))
+			wm_restack(wid, XCB_STACK_MODE_BELOW);
+		else if (!strcmp(mode, "toggle"))
+			wm_restack(wid, XCB_STACK_MODE_OPPOSITE);
+		else {
+			ctl_reply(c, "error unknown stacking mode %s\n", mode);
+			return;
+		}
+	} else {
+		ctl_reply(c, "error invalid command %s\n", cmd);
+		return;
 	}
 
-	return 0;
+	ctl_reply(c, "ok\n");
 }
 
 /*
- * Each time the pointer moves from one window to another, an
- * XCB_ENTER_NOTIFY event is fired. This is used to switch input focus
- * between windows to follow where the pointer is.
+ * Pagers and bars find the windows to display and the active one in
+ * properties of the root window, as defined by EWMH. These are updated
+ * along with the window table: a window being mapped is appended to the
+ * lists, and removing or restacking a window replaces the list once.
+ * A child of the root window identifies the WM, as required by the
+ * specification.
  */
 int
-cb_enter(xcb_generic_event_t *ev)
+ewmh_init()
 {
-	xcb_enter_notify_event_t *e;
-
-	e = (xcb_enter_notify_event_t *)ev;
+	uint32_t val = 1;
+	xcb_atom_t supported[] = {
+		atoms[NET_SUPPORTED],
+		atoms[NET_SUPPORTING_WM_CHECK],
+		atoms[NET_WM_NAME],
+		atoms[NET_CLIENT_LIST],
+		atoms[NET_CLIENT_LIST_STACKING],
+		atoms[NET_ACTIVE_WINDOW],
+		atoms[NET_WM_SYNC_REQUEST],
+		atoms[NET_WM_SYNC_REQUEST_COUNTER],
+	};
+	xcb_window_t wid;
 
-	if (wm_is_ignored(e->event))
-		return 0;
+	wid = xcb_generate_id(conn);
+	xcb_create_window(conn, XCB_COPY_FROM_PARENT, wid, scrn->root,
+		-1, -1, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+		XCB_COPY_FROM_PARENT, XCB_CW_OVERRIDE_REDIRECT, &val);
 
-	if (cursor.mode != GRAB_NONE)
-		return 0;
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, wid,
+		atoms[NET_SUPPORTING_WM_CHECK], XCB_ATOM_WINDOW, 32, 1, &wid);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, wid,
+		atoms[NET_WM_NAME], atoms[UTF8_STRING], 8, strlen("glazier"), "glazier");
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, scrn->root,
+		atoms[NET_SUPPORTING_WM_CHECK], XCB_ATOM_WINDOW, 32, 1, &wid);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, scrn->root,
+		atoms[NET_SUPPORTED], XCB_ATOM_ATOM, 32, LEN(supported), supported);
 
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->event);
+	active = XCB_WINDOW_NONE;
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, scrn->root,
+		atoms[NET_ACTIVE_WINDOW], XCB_ATOM_WINDOW, 32, 1, &active);
 
-	return wm_set_focus(e->event);
+	return 0;
 }
 
 /*
- * Whenever the input focus change from one window to another, both an
- * XCB_FOCUS_OUT and XCB_FOCUS_IN are fired.
- * This is the occasion to change the border color to represent focus.
+ * Add a window on top of the lists. Unless `publish` is 0, it is also
+ * appended to the root window properties.
  */
-int
-cb_focus(xcb_generic_event_t *ev)
+void
+ewmh_add(xcb_window_t wid, int publish)
 {
-	xcb_focus_in_event_t *e;
-
-	e = (xcb_focus_in_event_t *)ev;
+	int n;
+	void *p, *q;
+	struct client_t *c;
+
+	if (!(c = client(wid)) || c->listed)
+		return;
+
+	if (nclist == maxclist) {
+		n = maxclist ? maxclist * 2 : 64;
+		if (!(p = realloc(clist, n * sizeof(*clist))))
+			return;
+		clist = p;
+		if (!(q = realloc(slist, n * sizeof(*slist))))
+			return;
+		slist = q;
+		maxclist = n;
+	}
 
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x\n", XEV(e), e->event);
+	clist[nclist] = wid;
+	slist[nclist] = wid;
+	nclist++;
+	c->listed = 1;
 
-	switch(e->response_type & ~0x80) {
-	case XCB_FOCUS_IN:
-		curwid = e->event;
-		return paint(e->event);
-		break; /* NOTREACHED */
-	case XCB_FOCUS_OUT:
-		return paint(e->event);
-		break; /* NOTREACHED */
-	}
+	if (!publish)
+		return;
 
-	return -1;
+	xcb_change_property(conn, XCB_PROP_MODE_APPEND, scrn->root,
+		atoms[NET_CLIENT_LIST], XCB_ATOM_WINDOW, 32, 1, &wid);
+	xcb_change_property(conn, XCB_PROP_MODE_APPEND, scrn->root,
+		atoms[NET_CLIENT_LIST_STACKING], XCB_ATOM_WINDOW, 32, 1, &wid);
 }
 
-/*
- * XCB_CONFIGURE_REQUEST is triggered by every window that wants to
- * change its attributes like size, stacking order or border.
- * These must now be handled by the WM because of the
- * XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT registration.
- */
-int
-cb_configreq(xcb_generic_event_t *ev)
+void
+ewmh_del(xcb_window_t wid)
 {
-	int x, y, w, h;
-	xcb_configure_request_event_t *e;
+	int i, j;
+	struct client_t *c;
 
-	e = (xcb_configure_request_event_t *)ev;
+	if (!(c = client(wid)) || !c->listed)
+		return;
 
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x 0x%08x:%dx%d+%d+%d\n",
-			XEV(e), e->parent, e->window,
-			e->width, e->height,
-			e->x, e->y);
+	c->listed = 0;
+	for (i = j = 0; i < nclist; i++)
+		if (clist[i] != wid)
+			clist[j++] = clist[i];
 
-	if (e->value_mask &
-		( XCB_CONFIG_WINDOW_X
-		| XCB_CONFIG_WINDOW_Y
-		| XCB_CONFIG_WINDOW_WIDTH
-		| XCB_CONFIG_WINDOW_HEIGHT)) {
-		x = wm_get_attribute(e->window, ATTR_X);
-		y = wm_get_attribute(e->window, ATTR_Y);
-		w = wm_get_attribute(e->window, ATTR_W);
-		h = wm_get_attribute(e->window, ATTR_H);
+	for (i = j = 0; i < nclist; i++)
+		if (slist[i] != wid)
+			slist[j++] = slist[i];
+
+	nclist--;
+	ewmh_publish(NET_CLIENT_LIST);
+	ewmh_publish(NET_CLIENT_LIST_STACKING);
+}
 
-		if (e->value_mask & XCB_CONFIG_WINDOW_X) x = e->x;
-		if (e->value_mask & XCB_CONFIG_WINDOW_Y) y = e->y;
-		if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH)  w = e->width;
-		if (e->value_mask & XCB_CONFIG_WINDOW_HEIGHT) h = e->height;
+/*
+ * Move a window right above its new sibling in the stacking list, as
+ * told by XCB_CONFIGURE_NOTIFY. When the sibling isn't listed (eg. it
+ * is override_redirect), the stacking order is read from the server,
+ * without waiting for it.
+ */
+void
+ewmh_restack(struct client_t *c)
+{
+	int i, j, k;
+	unsigned int seq;
 
-		wm_teleport(e->window, x, y, w, h);
+	if (!c->listed)
+		return;
 
-		/* redraw border pixmap after move/resize */
-		paint(e->window);
+	for (i = 0; i < nclist && slist[i] != c->wid; i++);
+
+	if (c->above == XCB_WINDOW_NONE) {
+		k = 0;
+	} else {
+		for (j = 0; j < nclist && slist[j] != c->above; j++);
+		if (j == nclist) {
+			if (!restacking) {
+				restacking = 1;
+				seq = xcb_query_tree(conn, scrn->root).sequence;
+				defer(scrn->root, ewmh_tree, 1, &seq);
+			}
+			return;
+		}
+		k = j < i ? j + 1 : j;
 	}
 
-	if (e->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
-		wm_set_border(e->border_width, border_color, e->window);
+	if (k == i)
+		return;
 
-	if (e->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
-		wm_restack(e->window, e->stack_mode);
+	if (k < i)
+		memmove(&slist[k + 1], &slist[k], (i - k) * sizeof(*slist));
+	else
+		memmove(&slist[i], &slist[i + 1], (k - i) * sizeof(*slist));
+	slist[k] = c->wid;
 
-	return 0;
+	ewmh_publish(NET_CLIENT_LIST_STACKING);
 }
 
-int
-cb_configure(xcb_generic_event_t *ev)
+/*
+ * Continuation of ewmh_restack(): rebuild the stacking list from the
+ * order of the root window children.
+ */
+void
+ewmh_tree(xcb_window_t wid, void **r)
 {
-	xcb_configure_notify_event_t *e;
-
-	e = (xcb_configure_notify_event_t *)ev;
-
-	if (verbose)
-		fprintf(stderr, "%s 0x%08x %dx%d+%d+%d\n",
-			XEV(e), e->window,
-			e->width, e->height,
-			e->x, e->y);
+	int i, n, k;
+	xcb_window_t *w;
+	struct client_t *c;
+	xcb_query_tree_reply_t *t = r[0];
+
+	(void)wid;
+	restacking = 0;
+
+	if (!t)
+		return;
+
+	w = xcb_query_tree_children(t);
+	n = xcb_query_tree_children_length(t);
+
+	/*
+	 * Children that aren't listed, eg. override-redirect, are skipped.
+	 * Listed ones are marked with 2 until the end, to find the windows
+	 * that were listed since the tree was queried.
+	 */
+	for (i = k = 0; i < n && k < nclist; i++) {
+		if ((c = client(w[i])) && c->listed == 1) {
+			c->listed = 2;
+			slist[k++] = w[i];
+		}
+	}
 
-	/* update screen size when root window's size change */
-	if (e->window == scrn->root) {
-		scrn->width_in_pixels = e->width;
-		scrn->height_in_pixels = e->height;
+	/* windows listed since the tree was queried go on top */
+	for (i = 0; i < nclist; i++) {
+		if (!(c = client(clist[i])))
+			continue;
+		if (c->listed == 1 && k < nclist)
+			slist[k++] = clist[i];
+		c->listed = 1;
 	}
 
-	return 0;
+	ewmh_publish(NET_CLIENT_LIST_STACKING);
+}
+
+void
+ewmh_publish(int atom)
+{
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, scrn->root,
+		atoms[atom], XCB_ATOM_WINDOW, 32, nclist,
+		atom == NET_CLIENT_LIST ? clist : slist);
 }
 
 /*
- * This functions uses the ev_callback_t structure to call out a specific
- * callback function for each EVENT fired.
+ * Focus changes come as a pair of XCB_FOCUS_OUT and XCB_FOCUS_IN, so the
+ * active window is only published once both are processed.
+ * Return 1 if the property was changed, 0 otherwise.
  */
 int
-ev_callback(xcb_generic_event_t *ev)
+ewmh_flush()
 {
-	uint8_t i;
-	uint32_t type;
+	struct client_t *c;
+	xcb_window_t wid = XCB_WINDOW_NONE;
 
-	if (!ev)
-		return -1;
+	if ((c = client(focuswid)) && c->listed)
+		wid = focuswid;
 
-	type = ev->response_type & ~0x80;
-	for (i=0; i<LEN(cb); i++)
-		if (type == cb[i].type)
-			return cb[i].handle(ev);
+	if (wid == active)
+		return 0;
+
+	active = wid;
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, scrn->root,
+		atoms[NET_ACTIVE_WINDOW], XCB_ATOM_WINDOW, 32, 1, &active);
 
-	return cb_default(ev);
+	return 1;
 }
 
 /*
@@ -802,23 +4539,22 @@ crossedge(xcb_window_t wid)
 {
 	int r = 0;
 	int x, y, w, h, b;
-	xcb_randr_monitor_info_t *m;
+	struct monitor_t *m;
 
-	b = wm_get_attribute(wid, ATTR_B);
-	x = wm_get_attribute(wid, ATTR_X);
-	y = wm_get_attribute(wid, ATTR_Y);
-	w = wm_get_attribute(wid, ATTR_W);
-	h = wm_get_attribute(wid, ATTR_H);
-	m = wm_get_monitor(wm_find_monitor(x, y));
+	b = getattr(wid, ATTR_B);
+	x = getattr(wid, ATTR_X);
+	y = getattr(wid, ATTR_Y);
+	w = getattr(wid, ATTR_W);
+	h = getattr(wid, ATTR_H);
+	m = monitor(x, y);
 
 	if (!m)
 		return -1;
 
-	if ((x + w + 2*b > m->x + m->width)
-	 || (y + h + 2*b > m->y + m->height))
+	if ((x + w + 2*b > m->x + m->w)
+	 || (y + h + 2*b > m->y + m->h))
 		r = 1;
 
-	free(m);
 	return r;
 }
 
@@ -829,37 +4565,265 @@ int
 snaptoedge(xcb_window_t wid)
 {
 	int x, y, w, h, b;
-	xcb_randr_monitor_info_t *m;
+	struct monitor_t *m;
 
-	b = wm_get_attribute(wid, ATTR_B);
-	x = wm_get_attribute(wid, ATTR_X);
-	y = wm_get_attribute(wid, ATTR_Y);
-	w = wm_get_attribute(wid, ATTR_W);
-	h = wm_get_attribute(wid, ATTR_H);
-	m = wm_get_monitor(wm_find_monitor(x, y));
+	b = getattr(wid, ATTR_B);
+	x = getattr(wid, ATTR_X);
+	y = getattr(wid, ATTR_Y);
+	w = getattr(wid, ATTR_W);
+	h = getattr(wid, ATTR_H);
+	m = monitor(x, y);
 
 	if (!m)
 		return -1;
 
-	if (w + 2*b > m->width)  w = m->width - 2*b;
-	if (h + 2*b > m->height) h = m->height - 2*b;
+	if (w + 2*b > m->w) w = m->w - 2*b;
+	if (h + 2*b > m->h) h = m->h - 2*b;
+
+	if (x + w + 2*b > m->x + m->w) x = MAX(m->x, m->x + m->w - w - 2*b);
+	if (y + h + 2*b > m->y + m->h) y = MAX(m->y, m->y + m->h - h - 2*b);
+
+	teleport(wid, x, y, w, h);
+
+	return 0;
+}
+
+/*
+ * Intern all atoms used by the WM at once.
+ */
+int
+getatoms()
+{
+	int i;
+	xcb_intern_atom_cookie_t ck[ATOM_LAST];
+	xcb_intern_atom_reply_t *r;
+
+	for (i = 0; i < ATOM_LAST; i++)
+		ck[i] = xcb_intern_atom(conn, 0, strlen(atomname[i]), atomname[i]);
+
+	for (i = 0; i < ATOM_LAST; i++) {
+		if ((r = xcb_intern_atom_reply(conn, ck[i], NULL))) {
+			atoms[i] = r->atom;
+			free(r);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read the monitors layout, along with the duration of a frame in
+ * milliseconds on each of them, based on the refresh rate of the CRTC
+ * they are displayed on.
+ * Monitors come from RandR 1.5, which accounts for monitors spanning
+ * several CRTCs, or split with xrandr --setmonitor. Active CRTCs are used
+ * as monitors when the server doesn't know about them.
+ * All requests are sent before waiting on any reply.
+ */
+int
+getmonitors()
+{
+	int i, j, n, nmodes, ncrtcs = 0;
+	uint32_t vt, frame;
+	xcb_randr_crtc_t *id;
+	xcb_randr_mode_info_t *modes, *m;
+	xcb_randr_monitor_info_iterator_t it;
+	xcb_randr_get_monitors_cookie_t mck;
+	xcb_randr_get_screen_resources_current_cookie_t rck;
+	xcb_randr_get_crtc_info_cookie_t ck[LEN(monitors)];
+	xcb_randr_get_crtc_info_reply_t *ci;
+	xcb_randr_get_monitors_reply_t *mon;
+	xcb_randr_get_screen_resources_current_reply_t *res;
+	struct monitor_t crtcs[LEN(monitors)];
+
+	relayout = 0;
+	nmonitors = 0;
+
+	mck = xcb_randr_get_monitors(conn, scrn->root, 1);
+	rck = xcb_randr_get_screen_resources_current(conn, scrn->root);
+
+	if ((mon = xcb_randr_get_monitors_reply(conn, mck, NULL))) {
+		it = xcb_randr_get_monitors_monitors_iterator(mon);
+		for (; it.rem && nmonitors < (int)LEN(monitors); xcb_randr_monitor_info_next(&it)) {
+			monitors[nmonitors].x = it.data->x;
+			monitors[nmonitors].y = it.data->y;
+			monitors[nmonitors].w = it.data->width;
+			monitors[nmonitors].h = it.data->height;
+			monitors[nmonitors].interval = 0;
+			nmonitors++;
+		}
+		free(mon);
+	}
+
+	if (!(res = xcb_randr_get_screen_resources_current_reply(conn, rck, NULL)))
+		return -1;
+
+	id = xcb_randr_get_screen_resources_current_crtcs(res);
+	n = MIN((int)LEN(crtcs), xcb_randr_get_screen_resources_current_crtcs_length(res));
+	modes = xcb_randr_get_screen_resources_current_modes(res);
+	nmodes = xcb_randr_get_screen_resources_current_modes_length(res);
+
+	for (i = 0; i < n; i++)
+		ck[i] = xcb_randr_get_crtc_info(conn, id[i], res->config_timestamp);
+
+	for (i = 0; i < n; i++) {
+		if (!(ci = xcb_randr_get_crtc_info_reply(conn, ck[i], NULL)))
+			continue;
+
+		for (m = NULL, j = 0; j < nmodes; j++)
+			if (modes[j].id == ci->mode)
+				m = &modes[j];
+
+		if (m) {
+			frame = 0;
+			if (m->dot_clock && m->htotal && m->vtotal) {
+				vt = m->vtotal;
+				if (m->mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN)
+					vt *= 2;
+				if (m->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE)
+					vt /= 2;
+				frame = MAX(1,
+					(1000ULL * m->htotal * vt + m->dot_clock / 2) / m->dot_clock);
+			}
+
+			crtcs[ncrtcs].x = ci->x;
+			crtcs[ncrtcs].y = ci->y;
+			crtcs[ncrtcs].w = ci->width;
+			crtcs[ncrtcs].h = ci->height;
+			crtcs[ncrtcs].interval = frame;
+			ncrtcs++;
+		}
+
+		free(ci);
+	}
+
+	free(res);
+
+	if (!nmonitors) {
+		memcpy(monitors, crtcs, ncrtcs * sizeof(*crtcs));
+		nmonitors = ncrtcs;
+	}
 
-	if (x + w + 2*b > m->x + m->width) x = MAX(m->x, m->x + m->width - w - 2*b);
-	if (y + h + 2*b > m->y + m->height) y = MAX(m->y, m->y + m->height - h - 2*b);
+	/* a monitor spanning several CRTCs goes at the pace of the fastest */
+	for (i = 0; i < nmonitors; i++) {
+		for (j = 0; j < ncrtcs; j++) {
+			if (!crtcs[j].interval
+			 || crtcs[j].x >= monitors[i].x + monitors[i].w
+			 || crtcs[j].y >= monitors[i].y + monitors[i].h
+			 || crtcs[j].x + crtcs[j].w <= monitors[i].x
+			 || crtcs[j].y + crtcs[j].h <= monitors[i].y)
+				continue;
+
+			if (!monitors[i].interval || crtcs[j].interval < monitors[i].interval)
+				monitors[i].interval = crtcs[j].interval;
+		}
 
-	wm_teleport(wid, x, y, w, h);
+		if (verbose)
+			fprintf(stderr, "monitor %dx%d+%d+%d: %u ms per frame\n",
+				monitors[i].w, monitors[i].h,
+				monitors[i].x, monitors[i].y,
+				monitors[i].interval);
+	}
 
 	return 0;
 }
 
+/*
+ * Return the monitor at the given position, or NULL if it falls between
+ * monitors. The whole screen is used as a single monitor when RandR
+ * isn't available.
+ * Consecutive lookups tend to hit the same monitor, so it is checked
+ * first.
+ */
+struct monitor_t *
+monitor(int x, int y)
+{
+	int i;
+	struct monitor_t *m;
+	static struct monitor_t *last, screen;
+
+	if (relayout) {
+		getmonitors();
+		last = NULL;
+	}
+
+	if (!nmonitors) {
+		screen.w = scrn->width_in_pixels;
+		screen.h = scrn->height_in_pixels;
+		return &screen;
+	}
+
+	if ((m = last)
+	 && x >= m->x && x < m->x + m->w
+	 && y >= m->y && y < m->y + m->h)
+		return m;
+
+	for (i = 0; i < nmonitors; i++) {
+		m = &monitors[i];
+		if (x >= m->x && x < m->x + m->w
+		 && y >= m->y && y < m->y + m->h)
+			return last = m;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the duration of a frame, in milliseconds, on the monitor at the
+ * given position. `dflt` is returned when this cannot be determined.
+ */
+uint32_t
+interval(int x, int y, uint32_t dflt)
+{
+	struct monitor_t *m;
+
+	if ((m = monitor(x, y)) && m->interval)
+		return m->interval;
+
+	return dflt;
+}
+
 int
 main (int argc, char *argv[])
 {
 	int mask;
 	char *argv0;
+	int i, n, t, d;
+	FILE *f;
+	char buf[64];
+	struct pollfd pfd[3 + 1 + LEN(ctls)];
+	struct sigaction sa;
+	struct timespec ts = { 0, 1000000 };
 	xcb_generic_event_t *ev = NULL;
 
+#ifdef STATS
+	st_init();
+#endif
+
+	/* ARGBEGIN consumes the arguments, keep them for restart() */
+	if (!(args = calloc(argc + 1, sizeof(*args))))
+		return -1;
+	memcpy(args, argv, argc * sizeof(*args));
+
 	ARGBEGIN {
+	case 'c':
+		content = !content;
+		break;
+	case 'd':
+		debug = 1;
+		break;
+	case 'o':
+		opaque = !opaque;
+		break;
+	case 'R':
+		statefd = atoi(EARGF(usage(argv0)));
+		break;
+	case 's':
+		statsfile = EARGF(usage(argv0));
+		break;
+	case 'S':
+		ctlpath = EARGF(usage(argv0));
+		break;
 	case 'v':
 		verbose++;
 		break;
@@ -874,35 +4838,161 @@ main (int argc, char *argv[])
 	} ARGEND;
 
 	wm_init_xcb();
+#ifdef STATS
+	st_check();
+#endif
 	wm_get_screen();
 
 	curwid = scrn->root;
 
+	/* take over from scratch if the state can't be read */
+	if (statefd >= 0 && state_load(statefd) < 0)
+		statefd = -1;
+
 	/* needed to get notified of windows creation */
 	mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY
 		| XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY
 		| XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
 
-	if (!wm_reg_window_event(scrn->root, mask)) {
-		fprintf(stderr, "Cannot redirect root window event.\n");
-		return -1;
+	/* on restart, the server may not be done with the previous process */
+	for (i = 0; !wm_reg_window_event(scrn->root, mask); i++) {
+		if (statefd < 0 || i == 100) {
+			fprintf(stderr, "Cannot redirect root window event.\n");
+			return -1;
+		}
+		nanosleep(&ts, NULL);
 	}
 
 	xcb_grab_button(conn, 0, scrn->root, XCB_EVENT_MASK_BUTTON_PRESS,
 		XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, scrn->root,
 		XCB_NONE, XCB_BUTTON_INDEX_ANY, modifier);
 
-	takeover();
+	getatoms();
+	ewmh_init();
+
+	if (getcursors() < 0)
+		return -1;
+
+	/* needed to throttle interactive resizes, see syncsetup() */
+	xsync = xcb_get_extension_data(conn, &xcb_sync_id);
+	if (xsync && xsync->present) {
+		xcb_discard_reply(conn, xcb_sync_initialize(conn,
+			XCB_SYNC_MAJOR_VERSION, XCB_SYNC_MINOR_VERSION).sequence);
+	} else {
+		xsync = NULL;
+	}
+
+	/* get notified of monitors layout and mode changes */
+	randr = xcb_get_extension_data(conn, &xcb_randr_id);
+	if (randr && randr->present) {
+		xcb_randr_select_input(conn, scrn->root,
+			XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE
+			| XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+		/* restored along with the window table otherwise */
+		if (statefd < 0)
+			getmonitors();
+	} else {
+		randr = NULL;
+	}
+
+	if (content)
+		damage_init();
+
+	if (worker_init() < 0)
+		return -1;
+
+	ev_init();
+
+	if (pipe(sigfd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(sigfd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(sigfd[i], F_SETFL, O_NONBLOCK);
+	}
+
+	sa.sa_handler = sigusr1;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = sighup;
+	sigaction(SIGHUP, &sa, NULL);
+
+	if (statefd < 0)
+		takeover();
+	else
+		resume();
+
+	if (ctlpath && ctl_init(ctlpath) < 0)
+		return -1;
+
+	pfd[0].fd = xcb_get_file_descriptor(conn);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = resfd[0];
+	pfd[1].events = POLLIN;
+	pfd[2].fd = sigfd[0];
+	pfd[2].events = POLLIN;
 
 	for (;;) {
 		xcb_flush(conn);
-		ev = xcb_wait_for_event(conn);
-		if (!ev)
-			break;
+
+		if (dumpstats) {
+			dumpstats = 0;
+			if (!statsfile) {
+				stats(stderr);
+			} else if ((f = fopen(statsfile, "a"))) {
+				stats(f);
+				fclose(f);
+			}
+		}
+
+		/*
+		 * Wait on the connection rather than in xcb_wait_for_event(),
+		 * so that signals are handled right away, along with the
+		 * results of the worker thread. The wait ends when the next
+		 * color sample is due, or when the geometry waiting to be sent
+		 * by drag() may go. Continuations are called as soon as
+		 * their replies arrive. Configure requests and focus changes
+		 * are applied once the queue is drained, and the control
+		 * socket is only read from then.
+		 */
+		if (lookahead) {
+			ev = lookahead;
+			lookahead = NULL;
+		} else if (!(ev = xcb_poll_for_event(conn))) {
+			if (xcb_connection_has_error(conn))
+				break;
+			if (!pending_flush() && !config_flush() && !focus_flush()
+			 && !ewmh_flush() && !damage_flush()
+			 && !worker_flush() && !drag_flush()
+			 && !(ev = xcb_poll_for_queued_event(conn))) {
+				if (restarting && cursor.mode == GRAB_NONE) {
+					restarting = 0;
+					restart();
+				}
+				n = ctl_pollfd(pfd + 3, LEN(pfd) - 3);
+				t = drag_timeout();
+				d = damage_timeout();
+				poll(pfd, 3 + n, t < 0 || (d >= 0 && d < t) ? d : t);
+				if (pfd[2].revents)
+					while (read(sigfd[0], buf, sizeof(buf)) > 0)
+						;
+				ctl_handle(pfd + 3, n);
+			}
+			if (!ev)
+				continue;
+		}
+
+		if (motion == MOTION_COALESCE)
+			ev = coalesce(ev);
 
 		ev_callback(ev);
 		free(ev);
 	}
 
+	if (ctlfd >= 0)
+		unlink(ctlpath);
+
 	return wm_kill_xcb();
 }
@@ -0,0 +1,1015 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include <xcb/res.h>
+#include <xcb/xtest.h>
+
+#include "arg.h"
+
+#define LEN(x) (sizeof(x)/sizeof(x[0]))
+#define MIN(x,y) ((x)>(y)?(y):(x))
+
+/*
+ * Synthetic clients used to benchmark glazier.
+ *
+ * All the windows are created from a single connection, which is enough
+ * for the WM: every window is a top-level one, and glazier doesn't care
+ * about which client owns it.
+ * Each workload issues its operations one after the other, waits for the
+ * event that proves the WM handled it, and reports how long that took.
+ */
+
+enum {
+	W_TAKEOVER,
+	W_MAP,
+	W_CONFIGURE,
+	W_FOCUS,
+	W_DRAG,
+	W_RESTART,
+};
+
+struct win_t {
+	xcb_window_t wid;
+	int x, y, w, h, b;
+	int mapped, focused;
+};
+
+static const char *workname[] = {
+	[W_TAKEOVER]  = "takeover",
+	[W_MAP]       = "map",
+	[W_CONFIGURE] = "configure",
+	[W_FOCUS]     = "focus",
+	[W_DRAG]      = "drag",
+	[W_RESTART]   = "restart",
+};
+
+/* number of in-place restarts of the WM */
+#define RESTARTS 10
+
+/* windows laid out in a grid on top of the others, for pointer workloads */
+#define GRID 8
+#define CELLW 160
+#define CELLH 120
+
+char *argv0;
+
+static int nwin = 100;
+static int ndrags = 0;
+static int timeout = 10000;
+static int modindex = 6; /* Mod4, see glazier's config.def.h */
+static char *wmcmd = "./glazier";
+static char *statsfile = "xbench.stats";
+
+static xcb_connection_t *conn;
+static xcb_screen_t *scrn;
+static xcb_keycode_t modkey;
+static pid_t wm;
+
+static struct win_t *wins;
+static int nwins;
+static unsigned long *lat;
+
+void
+usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-h] [-n windows] [-d drags] [-m modifier] "
+	                "[-t timeout] [-s file] [-g glazier]\n", name);
+}
+
+/*
+ * Monotonic clock, in microseconds
+ */
+unsigned long
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void
+pause_ms(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Window IDs are handed out in increasing order by xcb_generate_id(), so
+ * the window table is sorted and can be searched by bisection.
+ */
+struct win_t *
+win(xcb_window_t wid)
+{
+	int lo = 0, hi = nwins - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (wins[mid].wid == wid)
+			return &wins[mid];
+		if (wins[mid].wid < wid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+struct win_t *
+win_create(int x, int y, int w, int h)
+{
+	uint32_t val[2], mask;
+	struct win_t *p;
+
+	p = &wins[nwins++];
+	p->wid = xcb_generate_id(conn);
+	p->x = x;
+	p->y = y;
+	p->w = w;
+	p->h = h;
+	p->b = 0;
+	p->mapped = 0;
+	p->focused = 0;
+
+	mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
+	val[0] = scrn->white_pixel;
+	val[1] = XCB_EVENT_MASK_STRUCTURE_NOTIFY
+	       | XCB_EVENT_MASK_FOCUS_CHANGE;
+
+	xcb_create_window(conn, XCB_COPY_FROM_PARENT, p->wid, scrn->root,
+		x, y, w, h, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+		scrn->root_visual, mask, val);
+
+	return p;
+}
+
+/*
+ * Update the window table from an event. Returns the window it concerns,
+ * or NULL if the event isn't about one of ours.
+ */
+struct win_t *
+handle(xcb_generic_event_t *ev)
+{
+	struct win_t *p = NULL;
+	xcb_configure_notify_event_t *ec;
+	xcb_focus_in_event_t *ef;
+
+	switch (ev->response_type & ~0x80) {
+	case XCB_MAP_NOTIFY:
+		if ((p = win(((xcb_map_notify_event_t *)ev)->window)))
+			p->mapped = 1;
+		break;
+	case XCB_UNMAP_NOTIFY:
+		if ((p = win(((xcb_unmap_notify_event_t *)ev)->window)))
+			p->mapped = 0;
+		break;
+	case XCB_CONFIGURE_NOTIFY:
+		ec = (xcb_configure_notify_event_t *)ev;
+		if ((p = win(ec->window))) {
+			p->x = ec->x;
+			p->y = ec->y;
+			p->w = ec->width;
+			p->h = ec->height;
+			p->b = ec->border_width;
+		}
+		break;
+	case XCB_FOCUS_IN:
+	case XCB_FOCUS_OUT:
+		ef = (xcb_focus_in_event_t *)ev;
+		if (ef->mode != XCB_NOTIFY_MODE_NORMAL)
+			break;
+		if ((p = win(ef->event)))
+			p->focused = (ev->response_type & ~0x80) == XCB_FOCUS_IN;
+		break;
+	}
+
+	return p;
+}
+
+/*
+ * Process events until the given condition holds for window p (or for
+ * all windows from p to p + n), or until the timeout expires.
+ * Returns 0 on success, -1 on timeout.
+ */
+int
+waitfor(struct win_t *p, int n, int (*cond)(struct win_t *, void *), void *arg)
+{
+	int i, ms;
+	unsigned long deadline;
+	struct pollfd pfd;
+	xcb_generic_event_t *ev;
+
+	pfd.fd = xcb_get_file_descriptor(conn);
+	pfd.events = POLLIN;
+	deadline = now() + timeout * 1000UL;
+
+	for (i = 0;;) {
+		while (i < n && cond(p + i, arg))
+			i++;
+		if (i == n)
+			return 0;
+
+		while ((ev = xcb_poll_for_event(conn))) {
+			handle(ev);
+			free(ev);
+		}
+		if (xcb_connection_has_error(conn)) {
+			fprintf(stderr, "connection to the X server lost\n");
+			exit(1);
+		}
+		if (cond(p + i, arg))
+			continue;
+		if (now() >= deadline)
+			return -1;
+
+		ms = (deadline - now()) / 1000 + 1;
+		poll(&pfd, 1, ms);
+	}
+}
+
+int
+is_mapped(struct win_t *p, void *arg)
+{
+	(void)arg;
+	return p->mapped;
+}
+
+int
+is_unmapped(struct win_t *p, void *arg)
+{
+	(void)arg;
+	return !p->mapped;
+}
+
+int
+is_bordered(struct win_t *p, void *arg)
+{
+	(void)arg;
+	return p->b > 0;
+}
+
+int
+is_unbordered(struct win_t *p, void *arg)
+{
+	(void)arg;
+	return p->b == 0;
+}
+
+int
+is_focused(struct win_t *p, void *arg)
+{
+	(void)arg;
+	return p->focused;
+}
+
+int
+is_at(struct win_t *p, void *arg)
+{
+	int *geom = arg;
+
+	return p->x == geom[0] && p->y == geom[1]
+	    && p->w == geom[2] && p->h == geom[3];
+}
+
+int
+cmplat(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long *)a;
+	unsigned long y = *(unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Print one line of results for a workload: the number of operations
+ * that completed, the overall throughput and the latency percentiles
+ * measured from the client side.
+ */
+void
+report(int w, int ops, int failed, unsigned long total)
+{
+	unsigned long p50 = 0, p99 = 0;
+
+	if (ops > 0) {
+		qsort(lat, ops, sizeof(*lat), cmplat);
+		p50 = lat[(ops - 1) * 50 / 100];
+		p99 = lat[(ops - 1) * 99 / 100];
+	}
+
+	printf("bench workload %s windows %d ops %d failed %d total_us %lu "
+	       "ops_per_sec %.1f p50_us %lu p99_us %lu\n",
+	       workname[w], nwin, ops, failed, total,
+	       total ? ops * 1e6 / total : 0.0, p50, p99);
+	fflush(stdout);
+}
+
+/*
+ * Start the WM in the background, moving windows themselves rather than
+ * an outline if `opaque` is set.
+ */
+void
+wmstart(int opaque)
+{
+	switch ((wm = fork())) {
+	case -1:
+		perror("fork");
+		exit(1);
+	case 0:
+		execl(wmcmd, wmcmd, "-s", statsfile,
+			opaque ? "-o" : (char *)NULL, (char *)NULL);
+		perror(wmcmd);
+		_exit(1);
+	}
+}
+
+/*
+ * Start the WM on top of nwin mapped windows, and wait until it adopted
+ * all of them, which is when their border is set.
+ */
+void
+takeover()
+{
+	int i, failed = 0;
+	unsigned long t0, t1;
+	struct win_t *p;
+
+	p = wins + nwins;
+	for (i = 0; i < nwin; i++) {
+		win_create((i * 13) % (scrn->width_in_pixels - 200),
+		           (i * 7) % (scrn->height_in_pixels - 200), 200, 150);
+		xcb_map_window(conn, wins[nwins - 1].wid);
+	}
+	xcb_flush(conn);
+	waitfor(p, nwin, is_mapped, NULL);
+
+	t0 = now();
+	wmstart(0);
+
+	if (waitfor(p, nwin, is_bordered, NULL) < 0)
+		for (i = 0; i < nwin; i++)
+			failed += !p[i].b;
+	t1 = now();
+
+	/* one operation: the time it took to adopt all the windows */
+	lat[0] = t1 - t0;
+	report(W_TAKEOVER, 1, failed, t1 - t0);
+}
+
+/*
+ * Create and map nwin new windows, one at a time, going through
+ * XCB_CREATE_NOTIFY and XCB_MAP_REQUEST in the WM. The last GRID * GRID
+ * ones are laid out in a grid, on top of everything else.
+ */
+void
+map()
+{
+	int i, g, ops = 0, failed = 0;
+	unsigned long t0, t;
+	struct win_t *p;
+
+	g = nwin - GRID * GRID;
+	t0 = now();
+	for (i = 0; i < nwin; i++) {
+		t = now();
+		if (i < g)
+			p = win_create(16 + (i * 11) % (scrn->width_in_pixels - 300),
+			               16 + (i * 5) % (scrn->height_in_pixels - 300),
+			               200, 150);
+		else
+			p = win_create(32 + (i - g) % GRID * (CELLW + 32),
+			               32 + (i - g) / GRID * (CELLH + 32),
+			               CELLW, CELLH);
+		xcb_map_window(conn, p->wid);
+		xcb_flush(conn);
+		if (waitfor(p, 1, is_mapped, NULL) < 0) {
+			failed++;
+			continue;
+		}
+		lat[ops++] = now() - t;
+	}
+
+	report(W_MAP, ops, failed, now() - t0);
+}
+
+/*
+ * Have every window resize itself, which goes through
+ * XCB_CONFIGURE_REQUEST in the WM, and through the border repaint.
+ */
+void
+configure()
+{
+	int i, ops = 0, failed = 0, geom[4];
+	uint32_t val[4];
+	unsigned long t0, t;
+	struct win_t *p;
+
+	t0 = now();
+	for (i = 0; i < nwins; i++) {
+		p = &wins[i];
+		geom[0] = p->x;
+		geom[1] = p->y;
+		geom[2] = p->w + (i % 2 ? -8 : 8);
+		geom[3] = p->h + (i % 2 ? -8 : 8);
+		val[0] = geom[0];
+		val[1] = geom[1];
+		val[2] = geom[2];
+		val[3] = geom[3];
+
+		t = now();
+		xcb_configure_window(conn, p->wid, XCB_CONFIG_WINDOW_X
+			| XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH
+			| XCB_CONFIG_WINDOW_HEIGHT, val);
+		xcb_flush(conn);
+		if (waitfor(p, 1, is_at, geom) < 0) {
+			failed++;
+			continue;
+		}
+		lat[ops++] = now() - t;
+	}
+
+	report(W_CONFIGURE, ops, failed, now() - t0);
+}
+
+void
+fake(uint8_t type, uint8_t detail, int x, int y)
+{
+	xcb_test_fake_input(conn, type, detail, XCB_CURRENT_TIME, scrn->root,
+		x, y, 0);
+}
+
+/*
+ * Move the pointer from one grid window to the next, so that the WM
+ * gets XCB_ENTER_NOTIFY and focuses the window underneath.
+ */
+void
+focus()
+{
+	int i, ops = 0, failed = 0;
+	unsigned long t0, t;
+	struct win_t *p, *grid;
+
+	grid = wins + nwins - GRID * GRID;
+	t0 = now();
+	for (i = 0; i < nwin; i++) {
+		p = &grid[i % (GRID * GRID)];
+		if (p->focused)
+			p = &grid[(i + 1) % (GRID * GRID)];
+
+		t = now();
+		fake(XCB_MOTION_NOTIFY, 0, p->x + p->w / 2, p->y + p->h / 2);
+		xcb_flush(conn);
+		if (waitfor(p, 1, is_focused, NULL) < 0) {
+			failed++;
+			continue;
+		}
+		lat[ops++] = now() - t;
+	}
+
+	report(W_FOCUS, ops, failed, now() - t0);
+}
+
+/*
+ * Drag one of the grid windows by 20 pixels with the modifier held down
+ * and the first button pressed, in ten motion steps `ms` milliseconds
+ * apart, and wait for it to reach its final position. Windows go right
+ * and back left on every other round, so they stay in place.
+ * Return the time it took in microseconds, or -1 on timeout.
+ */
+long
+dragone(int i, int ms)
+{
+	int s, x, y, dx, geom[4];
+	unsigned long t;
+	struct win_t *p;
+
+	/* the WM ignores presses that come within the same frame */
+	pause_ms(20);
+
+	p = &wins[nwins - GRID * GRID + i % (GRID * GRID)];
+	dx = (i / (GRID * GRID)) % 2 ? -20 : 20;
+	x = p->x + p->w / 2;
+	y = p->y + p->h / 2;
+	geom[0] = p->x + dx;
+	geom[1] = p->y;
+	geom[2] = p->w;
+	geom[3] = p->h;
+
+	t = now();
+	fake(XCB_MOTION_NOTIFY, 0, x, y);
+	fake(XCB_KEY_PRESS, modkey, 0, 0);
+	fake(XCB_BUTTON_PRESS, 1, 0, 0);
+	for (s = 1; s <= 10; s++) {
+		fake(XCB_MOTION_NOTIFY, 0, x + dx * s / 10, y);
+		if (ms > 0) {
+			xcb_flush(conn);
+			pause_ms(ms);
+		}
+	}
+	fake(XCB_BUTTON_RELEASE, 1, 0, 0);
+	fake(XCB_KEY_RELEASE, modkey, 0, 0);
+	xcb_flush(conn);
+
+	if (waitfor(p, 1, is_at, geom) < 0)
+		return -1;
+
+	return now() - t;
+}
+
+/*
+ * Drag the grid windows around. The latency is measured from the button
+ * press to the window reaching its final position.
+ */
+void
+drag()
+{
+	int i, ops = 0, failed = 0;
+	long t;
+	unsigned long t0;
+
+	t0 = now();
+	for (i = 0; i < MIN(nwin, 500); i++) {
+		if ((t = dragone(i, 0)) < 0)
+			failed++;
+		else
+			lat[ops++] = t;
+	}
+
+	report(W_DRAG, ops, failed, now() - t0);
+}
+
+/*
+ * Find the connection of the WM from the PID of its process, as told by
+ * the X-Resource extension, and return its resource base.
+ * Return 0 if the WM is not found.
+ */
+uint32_t
+wmclient()
+{
+	uint32_t base = 0;
+	xcb_res_client_id_spec_t spec;
+	xcb_res_client_id_value_iterator_t it;
+	xcb_res_query_client_ids_reply_t *ids;
+
+	spec.client = 0;
+	spec.mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID;
+	ids = xcb_res_query_client_ids_reply(conn,
+		xcb_res_query_client_ids(conn, 1, &spec), NULL);
+	if (!ids)
+		return 0;
+
+	it = xcb_res_query_client_ids_ids_iterator(ids);
+	for (; it.rem; xcb_res_client_id_value_next(&it))
+		if (it.data->length == 4
+		 && *xcb_res_client_id_value_value(it.data) == (uint32_t)wm)
+			base = it.data->spec.client;
+	free(ids);
+
+	return base;
+}
+
+/*
+ * Count the resources the WM holds on the server.
+ * Return -1 if the WM is not found.
+ */
+long
+wmresources()
+{
+	long n;
+	uint32_t base;
+	xcb_res_type_iterator_t rt;
+	xcb_res_query_client_resources_reply_t *res;
+
+	if (!(base = wmclient()))
+		return -1;
+
+	res = xcb_res_query_client_resources_reply(conn,
+		xcb_res_query_client_resources(conn, base), NULL);
+	if (!res)
+		return -1;
+
+	rt = xcb_res_query_client_resources_types_iterator(res);
+	for (n = 0; rt.rem; xcb_res_type_next(&rt))
+		n += rt.data->count;
+	free(res);
+
+	return n;
+}
+
+/*
+ * Count the bytes of pixmap memory the WM holds on the server.
+ * Return -1 if the WM is not found.
+ */
+long
+wmpixmaps()
+{
+	long n;
+	uint32_t base;
+	xcb_res_query_client_pixmap_bytes_reply_t *r;
+
+	if (!(base = wmclient()))
+		return -1;
+
+	r = xcb_res_query_client_pixmap_bytes_reply(conn,
+		xcb_res_query_client_pixmap_bytes(conn, base), NULL);
+	if (!r)
+		return -1;
+
+	n = r->bytes;
+	free(r);
+
+	return n;
+}
+
+/*
+ * Map a single window of growing sizes, up to the whole screen, and
+ * report how much pixmap memory the WM took for painting its borders,
+ * focused and not. The window is destroyed and dropped from the table
+ * afterwards, so it doesn't get in the way of the other workloads.
+ */
+void
+memory()
+{
+	size_t n;
+	long before, after;
+	struct win_t *p;
+	static const int sizes[][2] = {
+		{ 200, 150 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+		{ 3840, 2160 }, { 7680, 4320 },
+	};
+
+	for (n = 0; n < LEN(sizes); n++) {
+		if (sizes[n][0] > scrn->width_in_pixels
+		 || sizes[n][1] > scrn->height_in_pixels)
+			break;
+
+		before = wmpixmaps();
+		p = win_create(0, 0, sizes[n][0] - 32, sizes[n][1] - 32);
+		xcb_map_window(conn, p->wid);
+		xcb_flush(conn);
+		waitfor(p, 1, is_bordered, NULL);
+
+		/* the border is painted right after being set */
+		pause_ms(100);
+		after = wmpixmaps();
+
+		/* next to what a full size pixmap at 32 bpp would take */
+		printf("bench memory width %d height %d border %d "
+		       "pixmap_bytes %ld full_bytes %ld\n", p->w, p->h, p->b,
+		       after - before, 4L * (p->w + 2*p->b) * (p->h + 2*p->b));
+		fflush(stdout);
+
+		xcb_destroy_window(conn, p->wid);
+		xcb_flush(conn);
+		waitfor(p, 1, is_unmapped, NULL);
+
+		/* give the slot back, the grid must stay last in the table */
+		nwins--;
+	}
+}
+
+/*
+ * Drag windows over and over, and check that the number of resources
+ * held by the WM doesn't grow meanwhile. Resources are counted after a
+ * first round of drags, so that the ones created lazily are accounted
+ * for already.
+ */
+void
+soak()
+{
+	int i, failed = 0;
+	long before, after;
+	unsigned long t0;
+
+	for (i = 0; i < GRID * GRID; i++)
+		failed += dragone(i, 0) < 0;
+
+	before = wmresources();
+	t0 = now();
+	for (i = 0; i < ndrags; i++)
+		failed += dragone(i, 0) < 0;
+	after = wmresources();
+
+	printf("bench workload soak windows %d ops %d failed %d total_us %lu "
+	       "resources_before %ld resources_after %ld leaked %ld\n",
+	       nwin, ndrags, failed, now() - t0, before, after, after - before);
+	fflush(stdout);
+}
+
+/*
+ * Restart the WM in place with SIGHUP, and wait for the new process to
+ * publish the stacking order, which it does once it resumed from the
+ * state of the previous one.
+ */
+void
+restart()
+{
+	int i, got, ops = 0, failed = 0;
+	uint32_t mask;
+	unsigned long t0, t, deadline;
+	struct pollfd pfd;
+	xcb_atom_t atom;
+	xcb_intern_atom_reply_t *r;
+	xcb_generic_event_t *ev;
+
+	r = xcb_intern_atom_reply(conn, xcb_intern_atom(conn, 0,
+		strlen("_NET_CLIENT_LIST_STACKING"), "_NET_CLIENT_LIST_STACKING"),
+		NULL);
+	if (!r)
+		return;
+	atom = r->atom;
+	free(r);
+
+	mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+	xcb_change_window_attributes(conn, scrn->root, XCB_CW_EVENT_MASK, &mask);
+	xcb_flush(conn);
+
+	pfd.fd = xcb_get_file_descriptor(conn);
+	pfd.events = POLLIN;
+
+	t0 = now();
+	for (i = 0; i < RESTARTS; i++) {
+		/* let the new process settle before restarting it again */
+		pause_ms(100);
+		while ((ev = xcb_poll_for_event(conn))) {
+			handle(ev);
+			free(ev);
+		}
+
+		t = now();
+		deadline = t + timeout * 1000UL;
+		kill(wm, SIGHUP);
+
+		for (got = 0; !got && now() < deadline;) {
+			poll(&pfd, 1, (deadline - now()) / 1000 + 1);
+			while ((ev = xcb_poll_for_event(conn))) {
+				if ((ev->response_type & ~0x80) == XCB_PROPERTY_NOTIFY
+				 && ((xcb_property_notify_event_t *)ev)->atom == atom)
+					got = 1;
+				handle(ev);
+				free(ev);
+			}
+		}
+
+		if (!got) {
+			failed++;
+			continue;
+		}
+		lat[ops++] = now() - t;
+	}
+
+	mask = 0;
+	xcb_change_window_attributes(conn, scrn->root, XCB_CW_EVENT_MASK, &mask);
+
+	report(W_RESTART, ops, failed, now() - t0);
+}
+
+/*
+ * Find a keycode for the modifier that the WM expects to be held down
+ * during drags.
+ */
+xcb_keycode_t
+getmodkey()
+{
+	int i;
+	xcb_keycode_t k = 0, *codes;
+	xcb_get_modifier_mapping_reply_t *r;
+
+	r = xcb_get_modifier_mapping_reply(conn,
+		xcb_get_modifier_mapping(conn), NULL);
+	if (!r)
+		return 0;
+
+	codes = xcb_get_modifier_mapping_keycodes(r);
+	for (i = 0; i < r->keycodes_per_modifier && !k; i++)
+		k = codes[modindex * r->keycodes_per_modifier + i];
+
+	free(r);
+	return k;
+}
+
+/*
+ * Ask the WM to dump its statistics into the stats file, and wait until
+ * it stopped growing.
+ */
+void
+wmdump()
+{
+	off_t size = -1;
+	struct stat sb;
+	unsigned long deadline;
+
+	kill(wm, SIGUSR1);
+	deadline = now() + timeout * 1000UL;
+	while (now() < deadline) {
+		pause_ms(50);
+		if (stat(statsfile, &sb) < 0 || sb.st_size == 0)
+			continue;
+		if (sb.st_size == size)
+			break;
+		size = sb.st_size;
+	}
+}
+
+/*
+ * Copy the statistics of the WM to the output.
+ */
+void
+wmstats()
+{
+	int fd;
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	wmdump();
+	if ((fd = open(statsfile, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", statsfile, strerror(errno));
+		return;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+
+	close(fd);
+	fflush(stdout);
+}
+
+/*
+ * Read the drag totals of the WM, as dumped in its statistics: the
+ * number of drags, the requests they took and their duration in ms.
+ * Return -1 if the WM didn't report them.
+ */
+int
+wmdrags(unsigned long v[3])
+{
+	int r = -1;
+	char line[256];
+	FILE *f;
+
+	unlink(statsfile);
+	wmdump();
+	if (!(f = fopen(statsfile, "r")))
+		return -1;
+
+	while (r < 0 && fgets(line, sizeof(line), f))
+		if (sscanf(line, "drag %*s count %lu requests %lu ms %lu",
+		           &v[0], &v[1], &v[2]) == 3)
+			r = 0;
+
+	fclose(f);
+	return r;
+}
+
+/*
+ * Drag the grid windows at the pace of a 60 Hz pointer, with the WM
+ * drawing an outline, then once restarted with -o, moving the windows
+ * themselves, and report the requests each mode sends per second of
+ * dragging.
+ */
+void
+dragmodes()
+{
+	int i, mode, failed;
+	uint32_t zero = 0;
+	unsigned long before[3], after[3], drags, requests, ms;
+	struct win_t *p;
+	static const char *modename[] = { "outline", "opaque" };
+
+	p = &wins[nwins - GRID * GRID];
+	for (mode = 0; mode < 2; mode++) {
+		if (mode) {
+			kill(wm, SIGTERM);
+			waitpid(wm, NULL, 0);
+
+			/* the new WM sets the borders back once it took over */
+			for (i = 0; i < GRID * GRID; i++)
+				xcb_configure_window(conn, p[i].wid,
+					XCB_CONFIG_WINDOW_BORDER_WIDTH, &zero);
+			xcb_flush(conn);
+			waitfor(p, GRID * GRID, is_unbordered, NULL);
+
+			wmstart(1);
+			if (waitfor(p, GRID * GRID, is_bordered, NULL) < 0) {
+				fprintf(stderr, "opaque WM did not take over\n");
+				return;
+			}
+		}
+
+		failed = 0;
+		if (wmdrags(before) < 0)
+			return;
+		for (i = 0; i < GRID * GRID; i++)
+			failed += dragone(mode * GRID * GRID + i, 16) < 0;
+		if (wmdrags(after) < 0)
+			return;
+
+		drags = after[0] - before[0];
+		requests = after[1] - before[1];
+		ms = after[2] - before[2];
+		printf("bench dragmode %s drags %lu failed %d requests %lu "
+		       "drag_ms %lu requests_per_drag %.1f requests_per_sec %.1f\n",
+		       modename[mode], drags, failed, requests, ms,
+		       drags ? (double)requests / drags : 0.0,
+		       ms ? requests * 1000.0 / ms : 0.0);
+		fflush(stdout);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int status;
+
+	ARGBEGIN {
+	case 'n':
+		nwin = atoi(EARGF(usage(argv0)));
+		break;
+	case 'd':
+		ndrags = atoi(EARGF(usage(argv0)));
+		break;
+	case 'm':
+		modindex = 2 + atoi(EARGF(usage(argv0)));
+		break;
+	case 't':
+		timeout = atoi(EARGF(usage(argv0)));
+		break;
+	case 's':
+		statsfile = EARGF(usage(argv0));
+		break;
+	case 'g':
+		wmcmd = EARGF(usage(argv0));
+		break;
+	case 'h':
+		usage(argv0);
+		return 0;
+		break; /* NOTREACHED */
+	default:
+		usage(argv0);
+		return -1;
+		break; /* NOTREACHED */
+	} ARGEND;
+
+	if (nwin < GRID * GRID || modindex < 3 || modindex > 7) {
+		usage(argv0);
+		return -1;
+	}
+
+	conn = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(conn)) {
+		fprintf(stderr, "cannot connect to the X server\n");
+		return -1;
+	}
+
+	scrn = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+	modkey = getmodkey();
+
+	/* takeover() and map() create nwin windows each, memory() one more */
+	wins = calloc(2 * nwin + 1, sizeof(*wins));
+	lat = calloc(2 * nwin, sizeof(*lat));
+	if (!wins || !lat) {
+		perror("calloc");
+		return -1;
+	}
+
+	unlink(statsfile);
+
+	takeover();
+	map();
+	configure();
+	focus();
+	memory();
+	if (modkey) {
+		drag();
+		if (ndrags > 0)
+			soak();
+	} else {
+		fprintf(stderr, "no keycode for modifier %d, skipping drags\n",
+			modindex - 2);
+	}
+	wmstats();
+	restart();
+	if (modkey)
+		dragmodes();
+
+	kill(wm, SIGTERM);
+	waitpid(wm, &status, 0);
+	xcb_disconnect(conn);
+
+	free(wins);
+	free(lat);
+
+	return 0;
+}